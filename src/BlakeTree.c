@@ -0,0 +1,207 @@
+#include "BlakeTree.h"
+
+#include "log.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+
+size_t bt_leaf_size   = BT_DEFAULT_LEAF_SIZE;
+size_t bt_chunk_size  = BT_DEFAULT_CHUNK_SIZE;
+size_t bt_stage1_size = (BT_DEFAULT_CHUNK_SIZE / BT_DEFAULT_LEAF_SIZE) * HASH_LEN;
+
+
+size_t blakeTree_parse_size(const char* s)
+{
+	char* end;
+	unsigned long long n = strtoull(s, &end, 10);
+	switch(*end) {
+		case 'k': case 'K': n <<= 10; end++; break;
+		case 'm': case 'M': n <<= 20; end++; break;
+		case 'g': case 'G': n <<= 30; end++; break;
+	}
+	return (*end == 0) ? n : 0;
+}
+
+
+int blakeTree_set_geometry(size_t leaf_size, size_t chunk_size)
+{
+	// the OpenCL kernel only hashes whole blocks, and its counter is 32 bits
+	if(leaf_size < 64 || leaf_size % 64 != 0 || leaf_size >= (1u << 29)) {
+		return 0;
+	}
+	if(chunk_size < leaf_size || chunk_size % leaf_size != 0) {
+		return 0;
+	}
+	bt_leaf_size   = leaf_size;
+	bt_chunk_size  = chunk_size;
+	bt_stage1_size = (chunk_size / leaf_size) * HASH_LEN;
+	return 1;
+}
+
+
+// like blakeTreeCPU() does for leaves
+void blakeTree_hash_nodes(uint8_t* out, const uint8_t* in, size_t count, size_t node_len)
+{
+	size_t groups = count / BLAKE256_LEAF_LANES;
+	size_t gx;
+
+	#pragma omp parallel for if(groups > 1)
+	for(gx=0; gx < groups; gx++) {
+		const uint8_t *in_p = &( in[gx * BLAKE256_LEAF_LANES * node_len]);
+		uint8_t *out_p = &(out[gx * BLAKE256_LEAF_LANES * HASH_LEN]);
+		blake256_hash_leaves(out_p, in_p, node_len);
+	}
+
+	for(gx = groups * BLAKE256_LEAF_LANES; gx < count; gx++) {
+		blake256_hash_leaf(&(out[gx * HASH_LEN]), &(in[gx * node_len]), node_len);
+	}
+}
+
+
+// the top level of a height limited tree goes straight into the root
+static bool is_top(blakeTree_t* t, int level)
+{
+	return t->height && level == t->height - 2;
+}
+
+
+static void add_nodes(blakeTree_t* t, int level, const uint8_t* in, size_t count)
+{
+	if(level >= BT_MAX_LEVELS) {
+		loggerf(ERROR, "Logic error. Tree too high.");
+		exit(1);
+	}
+
+	t->nodes[level] += count;
+
+	if(t->fanout == 0 || is_top(t, level)) {
+		blake256_update(&t->root, in, count * HASH_LEN);
+		return;
+	}
+
+	if(t->npending[level] + count > t->cap[level]) {
+		t->cap[level] = 2 * (t->npending[level] + count);
+		t->pending[level] = realloc(t->pending[level], t->cap[level] * HASH_LEN);
+		if(!t->pending[level]) {
+			loggerf(ERROR, "Out of memory");
+			exit(1);
+		}
+	}
+	memcpy(&t->pending[level][t->npending[level] * HASH_LEN], in, count * HASH_LEN);
+	t->npending[level] += count;
+}
+
+
+// hash the complete nodes of a level (all of them if final) into the next
+// > a level is only reduced once it has more than fanout hashes, otherwise
+//   it might end up as the top level
+static void reduce(blakeTree_t* t, int level, bool final)
+{
+	size_t node_len = t->fanout * HASH_LEN;
+	size_t count, used;
+	uint8_t* out;
+
+	if(t->nodes[level] <= t->fanout) {
+		return;
+	}
+
+	count = t->npending[level] / t->fanout;
+	used  = count * t->fanout;
+	if(count == 0 && !final) {
+		return;
+	}
+
+	out = malloc((count + 1) * HASH_LEN);
+	if(t->hash_nodes) {
+		t->hash_nodes(t->hash_nodes_arg, out, t->pending[level], count, node_len);
+	} else {
+		blakeTree_hash_nodes(out, t->pending[level], count, node_len);
+	}
+
+	if(final && used < t->npending[level]) {
+		blake256_hash(&out[count * HASH_LEN], &t->pending[level][used * HASH_LEN],
+			(t->npending[level] - used) * HASH_LEN);
+		used = t->npending[level];
+		count++;
+	}
+
+	memmove(t->pending[level], &t->pending[level][used * HASH_LEN], 
+		(t->npending[level] - used) * HASH_LEN);
+	t->npending[level] -= used;
+
+	add_nodes(t, level + 1, out, count);
+	free(out);
+}
+
+
+void blakeTree_init(blakeTree_t* t, int fanout, int height)
+{
+	memset(t, 0, sizeof(blakeTree_t));
+	t->fanout = fanout;
+	t->height = height;
+	blake256_init(&t->root);
+}
+
+
+void blakeTree_update(blakeTree_t* t, const uint8_t* stage1, size_t size)
+{
+	blakeTree_update_level(t, 0, stage1, size);
+}
+
+
+void blakeTree_update_level(blakeTree_t* t, int level, const uint8_t* hashes, size_t size)
+{
+	uint64_t count = size / HASH_LEN;
+	uint64_t start = trace_begin();
+
+	// the lower levels count the hashes these were made of
+	for(int l = level - 1; l >= 0; l--) {
+		count *= t->fanout;
+		t->nodes[l] += count;
+	}
+
+	add_nodes(t, level, hashes, size / HASH_LEN);
+
+	for(; t->fanout && level < BT_MAX_LEVELS && t->npending[level]; level++) {
+		reduce(t, level, false);
+	}
+
+	trace_end("master", start, size);
+}
+
+
+void blakeTree_final(blakeTree_t* t, uint64_t length, uint8_t* out)
+{
+	uint8_t param[32];
+	int level;
+
+	if(t->fanout == 0) {
+		blake256_final(&t->root, out);
+		return;
+	}
+
+	// reduce bottom up until the top level, which goes into the root
+	for(level = 0; !is_top(t, level) && t->nodes[level] > t->fanout; level++) {
+		reduce(t, level, true);
+	}
+	if(t->npending[level]) {
+		blake256_update(&t->root, t->pending[level], t->npending[level] * HASH_LEN);
+	}
+
+	memset(param, 0, sizeof(param));
+	memcpy(param, "BTRE", 4);
+	U32TO8_BIG(param +  4, bt_leaf_size);
+	U32TO8_BIG(param +  8, t->fanout);
+	U32TO8_BIG(param + 12, t->height);
+	U32TO8_BIG(param + 16, level);
+	U64TO8_BIG(param + 24, length);
+	blake256_update(&t->root, param, sizeof(param));
+	blake256_final(&t->root, out);
+
+	for(level = 0; level < BT_MAX_LEVELS; level++) {
+		free(t->pending[level]);
+	}
+}
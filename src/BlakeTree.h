@@ -4,10 +4,69 @@
 
 #define HASH_LEN 32
 
-#define BT_LEAF_SIZE 2048
-#define FILE_BUFFER_SIZE (1 << 23)
-#define STAGE1_SIZE ((FILE_BUFFER_SIZE * HASH_LEN) / BT_LEAF_SIZE)
+#define BT_DEFAULT_LEAF_SIZE 2048
+#define BT_DEFAULT_CHUNK_SIZE (1 << 23)
 
-//#define PROFILING 1
+// Tree geometry, set at runtime with blakeTree_set_geometry()
+// > leaf size: bytes per leaf hash, a multiple of 64
+// > chunk size: bytes read and hashed at once, a multiple of the leaf size
+// > stage 1 size: leaf hashes of one chunk
+extern size_t bt_leaf_size;
+extern size_t bt_chunk_size;
+extern size_t bt_stage1_size;
+
+// sizes of the options: "2048", "64k", "8m", "1g", 0 on errors
+size_t blakeTree_parse_size(const char* s);
+
+// returns 0 if the geometry is invalid
+int blakeTree_set_geometry(size_t leaf_size, size_t chunk_size);
 
 //void calculateWorkGroups(size_t length, size_t *global, size_t *remainder);
+
+
+// Tree on top of the leaf hashes
+// > cake mode (fanout 0): the root is the plain hash of all leaf hashes,
+//   which is one long sequential hash
+// > tree mode: every fanout nodes of a level are hashed into one node of the
+//   next level, until a level has at most fanout nodes or the height limit
+//   is reached. The root hashes that top level and a parameter block
+//   (leaf size, fanout, height, length), so different shapes never collide.
+//   Height counts the leaves and the root, 0 means unlimited.
+#define BT_MAX_LEVELS 64
+
+// hashes count nodes of node_len bytes each, like blakeTree_hash_nodes()
+typedef void (*bt_nodes_fn)(void* arg, uint8_t* out, const uint8_t* in, size_t count,
+	size_t node_len);
+
+typedef struct {
+	int fanout;
+	int height;
+	// hashes the complete nodes of a level, NULL for blakeTree_hash_nodes()
+	// > the CPU pipeline hands them to the OpenMP team of its leaf stage
+	bt_nodes_fn hash_nodes;
+	void* hash_nodes_arg;
+	state256 root;
+
+	// hashes of each level that haven't been hashed into the next one
+	uint8_t* pending[BT_MAX_LEVELS];
+	size_t   npending[BT_MAX_LEVELS];
+	size_t   cap[BT_MAX_LEVELS];
+	uint64_t nodes[BT_MAX_LEVELS];  // all hashes a level received so far
+} blakeTree_t;
+
+void blakeTree_init(blakeTree_t* t, int fanout, int height);
+
+// hash count nodes of node_len bytes each into out, in parallel
+void blakeTree_hash_nodes(uint8_t* out, const uint8_t* in, size_t count, size_t node_len);
+
+// add the leaf (stage 1) hashes, in file order
+// > interior nodes are hashed in parallel as soon as they are complete
+void blakeTree_update(blakeTree_t* t, const uint8_t* stage1, size_t size);
+
+// add hashes of a higher level that were reduced elsewhere (on the GPU)
+// > the lower levels must have no pending hashes, i.e. every earlier batch
+//   was a whole number of nodes
+void blakeTree_update_level(blakeTree_t* t, int level, const uint8_t* hashes, size_t size);
+
+// length is the number of input bytes, frees the tree
+void blakeTree_final(blakeTree_t* t, uint64_t length, uint8_t* out);
@@ -2,26 +2,81 @@
 
 #include "blake.h"
 #include "log.h"
+#include "trace.h"
 
-void blakeTreeCPU(uint8_t* in, size_t length, uint8_t* out, size_t* out_size)
+#include <omp.h>
+#include <stdlib.h>
+#include <string.h>
+
+// OpenMP settings of the leaf loop, see BlakeTreeCPU.h
+// > only for the loop, the OpenMP settings of the caller stay as they are:
+//   the threads are a clause, the schedule is set for the loop and restored
+static int cpu_threads;
+static omp_sched_t cpu_schedule = omp_sched_static;
+static int cpu_schedule_chunk;
+
+
+int blakeTreeCPU_set_schedule(const char* spec)
+{
+	static const struct { const char* name; omp_sched_t kind; } kinds[] = {
+		{ "static", omp_sched_static }, { "dynamic", omp_sched_dynamic },
+		{ "guided", omp_sched_guided }, { "auto", omp_sched_auto }, { NULL }
+	};
+	size_t len = strcspn(spec, ",");
+	int chunk = 0;
+
+	if(spec[len] == ',') {
+		char* end;
+		chunk = strtol(&spec[len + 1], &end, 10);
+		if(*end != 0 || chunk < 1) {
+			return 0;
+		}
+	}
+	for(int i=0; kinds[i].name; i++) {
+		if(strlen(kinds[i].name) == len && strncmp(kinds[i].name, spec, len) == 0) {
+			cpu_schedule = kinds[i].kind;
+			cpu_schedule_chunk = chunk;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+void blakeTreeCPU_set_threads(int threads)
 {
-	size_t remainder  = length % BT_LEAF_SIZE;
-	size_t global     = length / BT_LEAF_SIZE;
+	cpu_threads = threads;
+}
+
+void blakeTreeCPU(const uint8_t* in, size_t length, size_t leaf_size, 
+	uint8_t* out, size_t* out_size)
+{
+	size_t remainder  = length % leaf_size;
+	size_t global     = length / leaf_size;
+	size_t groups     = global / BLAKE256_LEAF_LANES;
 
 	size_t gx; 
+	uint64_t start = trace_begin();
 
-	uint8_t *in_p, *out_p;
-	
-	/*
-	loggerf(DEBUG, "blakeTreeCPU: global: %d items  remainder: %d byte", 
-		global, remainder);
-	*/
-
-	#pragma omp parallel for
-	for(gx=0; gx < global; gx++) {
-		in_p  = &( in[gx * BT_LEAF_SIZE]);
-		out_p = &(out[gx * HASH_LEN]);
-		blake256_hash(out_p, in_p, BT_LEAF_SIZE);
+	int threads = cpu_threads ? cpu_threads : omp_get_max_threads();
+	omp_sched_t caller_schedule;
+	int caller_chunk;
+	omp_get_schedule(&caller_schedule, &caller_chunk);
+	omp_set_schedule(cpu_schedule, cpu_schedule_chunk);
+
+	// full groups of leaves go through the multi-buffer implementation
+	#pragma omp parallel for schedule(runtime) num_threads(threads)
+	for(gx=0; gx < groups; gx++) {
+		const uint8_t *in_p = &( in[gx * BLAKE256_LEAF_LANES * leaf_size]);
+		uint8_t *out_p = &(out[gx * BLAKE256_LEAF_LANES * HASH_LEN]);
+		uint64_t batch = trace_begin();
+		blake256_hash_leaves(out_p, in_p, leaf_size);
+		trace_end("leaf batch", batch, BLAKE256_LEAF_LANES * leaf_size);
+	}
+	omp_set_schedule(caller_schedule, caller_chunk);
+
+	for(gx = groups * BLAKE256_LEAF_LANES; gx < global; gx++) {
+		blake256_hash_leaf(&(out[gx * HASH_LEN]), &(in[gx * leaf_size]), leaf_size);
 	}
 	
 	*out_size = global * HASH_LEN;
@@ -29,10 +84,12 @@ void blakeTreeCPU(uint8_t* in, size_t length, uint8_t* out, size_t* out_size)
 	if(remainder) {
 		blake256_hash(
 			&(out[global * HASH_LEN]),
-			&(in[global * BT_LEAF_SIZE]), 
+			&(in[global * leaf_size]), 
 			remainder);
 
 
 		*out_size = (global + 1) * HASH_LEN;
 	}
+
+	trace_end("leaves", start, length);
 }
@@ -2,5 +2,16 @@
 
 #include "BlakeTree.h"
 
-void blakeTreeCPU(uint8_t* in, size_t length, uint8_t* out, size_t* out_size);
+// hashes the leaves of leaf_size bytes (the last one may be shorter)
+void blakeTreeCPU(const uint8_t* in, size_t length, size_t leaf_size, 
+	uint8_t* out, size_t* out_size);
 
+
+// OpenMP schedule of the leaf hashing, in the format of OMP_SCHEDULE:
+// "static" (default), "dynamic", "guided" or "auto", optionally followed
+// by ",chunk"
+// > returns 0 if spec is invalid
+int blakeTreeCPU_set_schedule(const char* spec);
+
+// OpenMP threads hashing leaves, 0 (default) leaves it to OpenMP
+void blakeTreeCPU_set_threads(int threads);
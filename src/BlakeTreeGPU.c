@@ -2,345 +2,990 @@
 #include "BlakeTreeCPU.h"
 #include <CL/opencl.h>
 #include <assert.h>
+#include <limits.h>
 #include <stdbool.h>
-#include <glib.h>
+#include <omp.h>
 
 #include "opencl-util.h"
+#include "blake256-cl.h"
+#include "file-reader.h"
 #include "log.h"
+#include "stats.h"
+#include "trace.h"
 
 // buffers
-// > organized in a FIFO queue
-#define NUM_BUFFERS 4
+// > every device has a pool of depth buffers, the ring holds the buffers in
+//   use in chunk order: filled in order by one producer thread
+//   (acquire_src, enqueue_src) and drained in order by one consumer thread
+//   (acquire_dst, release_dst)
+// > the devices finish their chunks in any order, the ring puts them back
+//   in order for the master update
+// > every buffer passes FREE -> FILLING -> ENQUEUED or EMPTY -> FREE
+enum slot_state {
+	SLOT_FREE,
+	SLOT_FILLING,   // acquired by the producer
+	SLOT_ENQUEUED,  // kernels enqueued, owned by the consumer
+	SLOT_EMPTY      // returned unused, skipped by the consumer
+};
+
+struct gpu_device;
 
 typedef struct {
-	uint8_t* src;
-	uint8_t* dst;
+	struct gpu_device* dev;
+	uint8_t* src;          // mapped while filling, see map_src
+	uint8_t* dst;          // mapped between acquire_dst and release_dst
+	uint8_t* src_host;     // map mode: aligned host memory for src, see map_src
 	cl_mem cm_src;
 	cl_mem cm_dst;
+	cl_mem cm_nodes;       // level 1 nodes, see reduce_nodes
 
-	bool busy;
+	enum slot_state state;
+	// released by the producer when the slot is reused, so it can wait for
+	// the head of a full ring while the consumer releases it
 	cl_event ev_src_unmap; // src has been copied to the GPU
 	cl_event ev_kernel;    // src has been hashed and dst can be read
+	cl_event ev_leaves;    // the leaf kernel, if profiled
+	cl_event ev_dst_unmap; // dst is released, the next kernels of the slot wait
 
+	size_t src_size;       // the part of the chunk hashed on the GPU
 	size_t dst_size;
+	size_t gpu_size;       // the part of dst_size hashed on the GPU
+	int level;             // tree level of the hashes in dst
 
-	// Uneven remainders are hashed by the CPU
-	// > when the result is acquired
-	size_t global_work_items;
-	size_t remainder;
+	// hybrid mode: the leaves after gpu_size are hashed on the CPU into
+	// cpu_dst, and both parts are put together in out
+	uint8_t* cpu_dst;
+	uint8_t* out;
+	double submitted;      // both parts got their work, see omp_get_wtime()
+	double gpu_done;       // set by gpu_done(), 0 until then
 
 } buffer_t;
 
-static buffer_t buffers[NUM_BUFFERS];
-GQueue *bufqueue;
+// OpenCL state of one device
+typedef struct gpu_device {
+	cl_device_id id;
+	cl_context context;
+	cl_command_queue q_compute;
+	cl_command_queue q_transfer;
+	cl_program program;
+	cl_kernel kernel;
+	cl_kernel kernel_tail;
+	cl_kernel kernel_nodes;
+	size_t local;          // work-group size of the leaf kernel
+	buffer_t* buffers;     // depth buffers
+	double rate;           // hybrid mode: GPU throughput in bytes/s
+} gpu_device_t;
+
+static gpu_device_t* devices;
+static int num_devices;
+static int depth;
+
+// devices in use, by their index over all platforms
+static bool device_selected[GPU_MAX_DEVICES];
+static bool device_all = true;
+static int device_last;  // the last device that got a chunk
+
+static buffer_t** ring;
+static int ring_size;        // num_devices * depth
+
+// slot = index % ring_size
+// > ring_head is only written by the consumer, the others by the producer
+static uint64_t ring_head;   // oldest slot in use
+static uint64_t ring_tail;   // next slot to acquire
+static uint64_t ring_next;   // next slot to enqueue
+
+// the buffer states and ring indices are shared between the two threads
+#define LOAD(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+// tree mode: full chunks are reduced to level 1 nodes on the GPU
+// > only if a chunk holds a whole number of nodes and level 0 can't be the
+//   top level, which would go into the root unreduced (see BlakeTree.c)
+static bool reduce_nodes;
+static int gpu_fanout;
+
+
+// leaf kernels, see blake256.cl
+#define STAGE_WG 64
 
+typedef struct {
+	const char* name;
+	const char* function;
+	size_t local;  // required local size, 0 if any
+} gpu_kernel_t;
+
+static const gpu_kernel_t gpu_kernels[] = {
+	{ "staged", "blake256_hash_block_staged", STAGE_WG },
+	{ "simple", "blake256_hash_block",        0 },
+	{ NULL }
+};
+
+static const gpu_kernel_t* gpu_kernel = &gpu_kernels[0];
+static size_t gpu_local;  // for kernels without a required size, 0 if any
+
+
+// host <-> device transfers
+// > map: the buffers are allocated by the driver (pinned) and mapped, src is
+//   read into them directly
+// > copy: the buffers wrap host memory and are written and read explicitly
+// > either way only the used part of a buffer crosses the bus
+enum gpu_transfer { GPU_TRANSFER_MAP, GPU_TRANSFER_COPY };
+
+static const char* transfer_names[] = { "map", "copy", NULL };
+static enum gpu_transfer transfer = GPU_TRANSFER_MAP;
+
+// alignment of src for O_DIRECT reads, 0 if any
+// > map mode: the driver's pinned memory has no alignment guarantee, so
+//   cm_src wraps aligned host memory, which a map returns as it is
+static size_t src_align;
+static bool src_unaligned;  // logged once
+
+// src is mapped in map mode, but not with the hybrid split: the CPU hashes
+// its part while the GPU has the rest, so src stays in host memory and the
+// GPU part is written like in copy mode
+static bool map_src;
+
+// hybrid mode: the GPU hashes the first part of every chunk, the CPU the rest
+// > share is the GPU part of the leaves, < 0 if the CPU isn't used
+// > auto: the share follows the measured throughput of the CPU and all
+//   devices together, in bytes/s
+// > both sides are timed by the host clock from the moment the chunk is
+//   split, so a device that is still busy with older chunks is slower
+static double hybrid_share = -1;
+static bool hybrid_auto;
+static double rate_cpu;
+
+#define HYBRID_SMOOTHING 0.25
+
+#ifdef CL_MAP_WRITE_INVALIDATE_REGION
+#define MAP_SRC CL_MAP_WRITE_INVALIDATE_REGION
+#else
+#define MAP_SRC CL_MAP_WRITE
+#endif
+
+
+int blakeTreeGPU_select_kernel(const char* name)
+{
+	for(const gpu_kernel_t* k = gpu_kernels; k->name; k++) {
+		if(strcmp(k->name, name) == 0) {
+			gpu_kernel = k;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+void blakeTreeGPU_set_local(size_t local)
+{
+	gpu_local = local;
+}
 
-// global OpenCL state
-static cl_device_id device_id;
-static cl_context context;
-static cl_command_queue q_compute;
-static cl_command_queue q_transfer;
-static cl_program program;
-static cl_kernel kernel;
+
+void blakeTreeGPU_align_src(size_t align)
+{
+	src_align = align;
+}
+
+
+int blakeTreeGPU_select_transfer(const char* name)
+{
+	for(int i = 0; transfer_names[i]; i++) {
+		if(strcmp(transfer_names[i], name) == 0) {
+			transfer = i;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+int blakeTreeGPU_select_devices(const char* list)
+{
+	if(strcmp(list, "all") == 0) {
+		device_all = true;
+		return 1;
+	}
+
+	device_all = false;
+	memset(device_selected, 0, sizeof(device_selected));
+	for(const char* p = list;; ) {
+		char* end;
+		long i = strtol(p, &end, 10);
+		if(end == p || i < 0 || i >= GPU_MAX_DEVICES) {
+			return 0;
+		}
+		device_selected[i] = true;
+		if(*end == 0) {
+			return 1;
+		}
+		if(*end != ',') {
+			return 0;
+		}
+		p = end + 1;
+	}
+}
+
+
+int blakeTreeGPU_set_hybrid(const char* arg)
+{
+	char* end;
+
+	if(!arg) {
+		hybrid_share = -1;
+		hybrid_auto = false;
+		return 1;
+	}
+	if(strcmp(arg, "auto") == 0) {
+		hybrid_share = 0.5;
+		hybrid_auto = true;
+		return 1;
+	}
+	hybrid_share = strtod(arg, &end);
+	hybrid_auto = false;
+	return *end == 0 && hybrid_share >= 0 && hybrid_share <= 1;
+}
+
+
+// smoothed throughput of one side
+static void update_rate(double* rate, size_t bytes, double sec)
+{
+	if(bytes == 0 || sec <= 0) {
+		return;
+	}
+	if(*rate == 0) {
+		*rate = bytes / sec;
+	} else {
+		*rate += HYBRID_SMOOTHING * (bytes / sec - *rate);
+	}
+
+	double rate_gpu = 0;
+	for(int d = 0; d < num_devices; d++) {
+		rate_gpu += devices[d].rate;
+	}
+	if(rate_gpu > 0 && rate_cpu > 0) {
+		hybrid_share = rate_gpu / (rate_gpu + rate_cpu);
+	}
+}
+
+
+// from the start of first to the end of last, 0 without profiling
+static double event_span(cl_event first, cl_event last)
+{
+	cl_ulong start, end;
+	if(clGetEventProfilingInfo(first, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL) != CL_SUCCESS ||
+		clGetEventProfilingInfo(last, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL) != CL_SUCCESS)
+	{
+		return 0;
+	}
+	return (end - start) * 1e-9;
+}
+
+
+static double event_seconds(cl_event ev)
+{
+	return event_span(ev, ev);
+}
+
+
+// hybrid mode: the GPU part of bp is done
+static void CL_CALLBACK gpu_done(cl_event ev, cl_int status, void* bp)
+{
+	double now = omp_get_wtime();
+	__atomic_store(&((buffer_t*) bp)->gpu_done, &now, __ATOMIC_RELEASE);
+}
+
+
+static bool event_done(cl_event ev)
+{
+	cl_int status;
+	if(clGetEventInfo(ev, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL) != CL_SUCCESS) {
+		return false;
+	}
+	return status == CL_COMPLETE;
+}
 
 
 void blakeTreeGPU_alloc_buffer(buffer_t* bp);
 void blakeTreeGPU_free_buffer(buffer_t* bp);
 
 
-void blakeTreeGPU_init()
+// context, program, queues, kernels and buffers of one device
+static void setup_device(gpu_device_t* dev, const char* options)
 {
 	int err;
 
-	// Determine platform
-	// > use the first GPU
-	//
+	dev->context = clCreateContext(0, 1, &dev->id, NULL, NULL, &err);
+	ocl_assert(err);
+
+	// the kernel source is embedded, see the Makefile
+	dev->program = ocl_build_program(dev->context, dev->id, blake256_cl, options);
+
+	// queues
+	// > the event timestamps feed the hybrid split and the statistics
+	cl_command_queue_properties properties = 
+		stats_enabled ? CL_QUEUE_PROFILING_ENABLE : 0;
+	dev->q_transfer = clCreateCommandQueue(dev->context, dev->id, properties, &err);
+	ocl_assert(err);
+	dev->q_compute  = clCreateCommandQueue(dev->context, dev->id, properties, &err);
+	ocl_assert(err);
+
+	dev->kernel = clCreateKernel(dev->program, gpu_kernel->function, &err);
+	ocl_assert(err);
+	dev->kernel_tail = clCreateKernel(dev->program, "blake256_hash_tail", &err);
+	ocl_assert(err);
+	dev->kernel_nodes = clCreateKernel(dev->program, "blake256_hash_nodes", &err);
+	ocl_assert(err);
+
+	if(gpu_kernel->local) {
+		dev->local = gpu_kernel->local;
+	} else {
+		err = clGetKernelWorkGroupInfo(dev->kernel, dev->id, 
+			CL_KERNEL_WORK_GROUP_SIZE, sizeof(dev->local), &dev->local, NULL);
+		ocl_assert(err);
+		// a requested size the device can't run falls back to the default
+		if(gpu_local && gpu_local <= dev->local) {
+			dev->local = gpu_local;
+		} else {
+			dev->local = (dev->local >> 8) << 8;
+			if(dev->local < 32) {
+				dev->local = 32;
+			}
+		}
+	}
+
+	// buffers
+	dev->buffers = calloc(depth, sizeof(buffer_t));
+	assert(dev->buffers);
+	for(int i=0; i < depth; i++) {
+		dev->buffers[i].dev = dev;
+		blakeTreeGPU_alloc_buffer(&dev->buffers[i]);
+	}
+	dev->rate = 0;
+}
+
+
+// Determine platforms and devices
+// > every GPU, or every device of the type in BLAKETREE_CL_DEVICE
+//   (gpu, cpu, accelerator, all), unless selected by index
+// > returns the number of devices in ids, logs them if verbose
+static int find_devices(cl_device_id* ids, const char** type_name, bool verbose)
+{
+	int err, found = 0;
+
+	cl_device_type type = CL_DEVICE_TYPE_GPU;
+	*type_name = getenv(GPU_DEVICE_ENV);
+	if(*type_name) {
+		if(strcmp(*type_name, "cpu") == 0) {
+			type = CL_DEVICE_TYPE_CPU;
+		} else if(strcmp(*type_name, "accelerator") == 0) {
+			type = CL_DEVICE_TYPE_ACCELERATOR;
+		} else if(strcmp(*type_name, "all") == 0) {
+			type = CL_DEVICE_TYPE_ALL;
+		} else if(strcmp(*type_name, "gpu") != 0) {
+			if(verbose) {
+				loggerf(ERROR, "%s: unknown device type \"%s\", using gpu", GPU_DEVICE_ENV, *type_name);
+			}
+		}
+	}
+
 	const int max_platforms = 16;
 	cl_platform_id platforms[max_platforms];
 	cl_uint num_platforms;
 	err = clGetPlatformIDs(max_platforms, platforms, &num_platforms);
 	ocl_assert(err);
 
-	int success = 0;
-	for(int i=0; i < num_platforms && !success; i++) {
-		cl_platform_id pid = platforms[i];
-		err = clGetDeviceIDs(pid, CL_DEVICE_TYPE_GPU, 1, &device_id, NULL);
-		if (err == CL_SUCCESS)
-		{
-			success = 1;
-			char info[256];
-			clGetPlatformInfo(pid, CL_PLATFORM_NAME, 256, info, NULL);
-			loggerf(DEBUG, "Using platform: %s", info);
+	int index = 0;
+	for(int i=0; i < num_platforms && index < GPU_MAX_DEVICES; i++) {
+		cl_device_id platform_ids[GPU_MAX_DEVICES];
+		cl_uint n;
+		if(clGetDeviceIDs(platforms[i], type, GPU_MAX_DEVICES, platform_ids, &n) != CL_SUCCESS) {
+			continue;
+		}
+		char platform[256];
+		clGetPlatformInfo(platforms[i], CL_PLATFORM_NAME, sizeof(platform), platform, NULL);
+
+		for(int j=0; j < n && j < GPU_MAX_DEVICES && index < GPU_MAX_DEVICES; j++, index++) {
+			char name[256];
+			clGetDeviceInfo(platform_ids[j], CL_DEVICE_NAME, sizeof(name), name, NULL);
+			if(device_all || device_selected[index]) {
+				if(verbose) {
+					loggerf(DEBUG, "Using platform: %s, device %d: %s", platform, index, name);
+				}
+				ids[found++] = platform_ids[j];
+			} else if(verbose) {
+				loggerf(DEBUG, "Skipping platform: %s, device %d: %s", platform, index, name);
+			}
 		}
 	}
-	if(!success) {
-		loggerf(ERROR, "No OpenCL capable GPU found.");
-		exit(1);
-	}
-	  
-	context = clCreateContext(0, 1, &device_id, NULL, NULL, &err);
-	ocl_assert(err);
+	return found;
+}
 
-	// Read the programs
-	char *sources[16];
-	char *source_files[] = {
-		"blake256.cl", 
-	};
-	int sources_count = sizeof(source_files)/sizeof(char*);
-	for(int i=0; i<sources_count; i++) {
-		loggerf(DEBUG, "Using OpenCL source: %s", source_files[i]);
-		FILE *f = fopen(source_files[i], "r");
-		assert(f);
-		fseek(f, 0, SEEK_END);
-		int flen = ftell(f);
-		fseek(f, 0, SEEK_SET);
-		sources[i] = malloc(flen + 1); 
-		assert(sources[i]);
-		fread(sources[i], 1, flen, f);
-		sources[i][flen] = 0;
-		fclose(f);
-	}
-
-	program = clCreateProgramWithSource(context, sources_count, 
-		(const char **) sources, NULL, &err);
-	ocl_assert(err);
 
-	for(int i=0; i < sources_count; i++) {
-		free(sources[i]);
+void blakeTreeGPU_identity(char* buf, size_t size)
+{
+	cl_device_id ids[GPU_MAX_DEVICES];
+	const char* type_name;
+	int n = find_devices(ids, &type_name, false);
+	size_t len = 0;
+
+	buf[0] = 0;
+	for(int i=0; i < n && len < size; i++) {
+		char name[256], driver[256];
+		clGetDeviceInfo(ids[i], CL_DEVICE_NAME, sizeof(name), name, NULL);
+		clGetDeviceInfo(ids[i], CL_DRIVER_VERSION, sizeof(driver), driver, NULL);
+		len += snprintf(&buf[len], size - len, "%s%s (%s)", i ? ", " : "", name, driver);
 	}
+}
 
-	err = clBuildProgram(program, 0, NULL, "-cl-mad-enable", NULL, NULL);
-	if (err != CL_SUCCESS)
-	{
-		logger(ERROR, "Failed to build program executable!");
-		size_t len;
-		char buffer[0x100000];
-		clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, 
-			sizeof(buffer), buffer, &len);
-		logger(ERROR, buffer);
+
+void blakeTreeGPU_init(int fanout, int height, int ring_depth)
+{
+	cl_device_id ids[GPU_MAX_DEVICES];
+	const char* type_name;
+
+	devices = calloc(GPU_MAX_DEVICES, sizeof(gpu_device_t));
+	assert(devices);
+	num_devices = find_devices(ids, &type_name, true);
+	for(int d=0; d < num_devices; d++) {
+		devices[d].id = ids[d];
+	}
+	if(num_devices == 0) {
+		loggerf(ERROR, "No OpenCL capable %s found.", type_name ? type_name : "GPU");
 		exit(1);
 	}
 
-	// queues
-	cl_command_queue_properties properties;
-	#ifdef PROFILING
-		properties = CL_QUEUE_PROFILING_ENABLE;
-	#else
-		properties = 0;
-	#endif
-	q_transfer = clCreateCommandQueue(context, device_id, properties, &err);
-	ocl_assert(err);
-	q_compute  = clCreateCommandQueue(context, device_id, properties, &err);
-	ocl_assert(err);
+	// the node kernel hashes whole blocks, so an even fanout is needed
+	// > not with the hybrid split, a chunk comes back in two parts
+	size_t leaves = bt_chunk_size / bt_leaf_size;
+	gpu_fanout   = fanout;
+	reduce_nodes = fanout > 0 && fanout % 2 == 0 && (height == 0 || height > 2) &&
+		leaves % fanout == 0 && leaves > fanout && hybrid_share < 0;
+	if(reduce_nodes) {
+		loggerf(DEBUG, "Reducing leaf hashes on the GPU, %zu nodes per chunk", leaves / fanout);
+	}
 
-	kernel = NULL;
+	// common leaf sizes get a kernel specialized at build time
+	char options[256];
+	bool pow2 = (bt_leaf_size & (bt_leaf_size - 1)) == 0;
+	if(pow2 && bt_leaf_size <= 4096) {
+		snprintf(options, sizeof(options), "-cl-mad-enable -D STAGE_WG=%d -D LEAF_SIZE=%zu", 
+			STAGE_WG, bt_leaf_size);
+	} else {
+		snprintf(options, sizeof(options), "-cl-mad-enable -D STAGE_WG=%d", STAGE_WG);
+	}
+	loggerf(DEBUG, "OpenCL build options: %s", options);
+	loggerf(DEBUG, "OpenCL kernel: %s", gpu_kernel->function);
 
-	// buffers
-	bufqueue = g_queue_new();
-	for(int i=0; i < NUM_BUFFERS; i++) {
-		blakeTreeGPU_alloc_buffer(&buffers[i]);
+	depth = ring_depth;
+	map_src = transfer == GPU_TRANSFER_MAP && hybrid_share < 0;
+	for(int d=0; d < num_devices; d++) {
+		setup_device(&devices[d], options);
 	}
 
-	kernel = clCreateKernel(program, "blake256_hash_block", &err);
-	ocl_assert(err);
+	ring_size = num_devices * depth;
+	ring = calloc(ring_size, sizeof(buffer_t*));
+	assert(ring);
+	ring_head = ring_tail = ring_next = 0;
+	device_last = num_devices - 1;
+
+	loggerf(DEBUG, "GPU devices: %d, ring depth: %d per device, transfers: %s", 
+		num_devices, depth, transfer_names[transfer]);
+	if(hybrid_share >= 0) {
+		rate_cpu = 0;
+		loggerf(DEBUG, "Hybrid mode, GPU share: %s", hybrid_auto ? "auto" : "fixed");
+	}
 }
 
 
 void blakeTreeGPU_close() {
-	for(int i=0; i < NUM_BUFFERS; i++) {
-		blakeTreeGPU_free_buffer(&buffers[i]);
-	}
-	clReleaseProgram(program);
-	clReleaseCommandQueue(q_compute);
-	clReleaseCommandQueue(q_transfer);
-	clReleaseContext(context);
-	g_queue_free(bufqueue);
+	for(int d=0; d < num_devices; d++) {
+		gpu_device_t* dev = &devices[d];
+		for(int i=0; i < depth; i++) {
+			blakeTreeGPU_free_buffer(&dev->buffers[i]);
+		}
+		free(dev->buffers);
+		clReleaseKernel(dev->kernel);
+		clReleaseKernel(dev->kernel_tail);
+		clReleaseKernel(dev->kernel_nodes);
+		clReleaseProgram(dev->program);
+		clReleaseCommandQueue(dev->q_compute);
+		clReleaseCommandQueue(dev->q_transfer);
+		clReleaseContext(dev->context);
+	}
+	free(devices);
+	free(ring);
 }
 
 
-uint8_t* blakeTreeGPU_acquire_src() {
-	//loggerf(DEBUG, "acquire_src, queue len: %d", g_queue_get_length(bufqueue));
-	
-	if(g_queue_get_length(bufqueue) >= NUM_BUFFERS) {
-		buffer_t* h = g_queue_peek_head(bufqueue);
-		clWaitForEvents(1, &h->ev_kernel);
-		return NULL;
+// a free buffer of the device with the fewest chunks in flight
+// > a chunk is in flight until its kernels are done, so a faster device
+//   gets more chunks, ties go round-robin
+static buffer_t* pick_buffer(void)
+{
+	buffer_t* best = NULL;
+	int best_busy = INT_MAX;
+
+	for(int k=1; k <= num_devices; k++) {
+		int d = (device_last + k) % num_devices;
+		buffer_t* free_bp = NULL;
+		int busy = 0;
+
+		for(int i=0; i < depth; i++) {
+			buffer_t* bp = &devices[d].buffers[i];
+			enum slot_state state = LOAD(&bp->state);
+			if(state == SLOT_FREE) {
+				if(!free_bp) {
+					free_bp = bp;
+				}
+			} else if(state == SLOT_FILLING || 
+				(state == SLOT_ENQUEUED && !event_done(bp->ev_kernel)))
+			{
+				busy++;
+			}
+		}
+		if(free_bp && busy < best_busy) {
+			best = free_bp;
+			best_busy = busy;
+		}
 	}
+	if(best) {
+		device_last = best->dev - devices;
+	}
+	return best;
+}
 
-	buffer_t* new = NULL;
 
-	bool foundfree = false;
-	for(int i=0; i < NUM_BUFFERS && !foundfree; i++) {
-		if(!buffers[i].busy) {
-			new = &buffers[i];
-			new->busy = true;
-			g_queue_push_tail(bufqueue, new);
-			//loggerf(DEBUG, "push_tail");
-			foundfree = true;
+uint8_t* blakeTreeGPU_acquire_src() {
+	uint64_t h = LOAD(&ring_head);
+
+	if(ring_tail - h >= ring_size) {
+		buffer_t* head = ring[h % ring_size];
+		if(LOAD(&head->state) == SLOT_ENQUEUED) {
+			double start = stats_now();
+			uint64_t trace = trace_begin();
+			clWaitForEvents(1, &head->ev_kernel);
+			stats_add(STATS_STALL, stats_now() - start, 0);
+			trace_end("gpu wait", trace, 0);
 		}
+		return NULL;
 	}
 
+	// a buffer is free for every free slot of the ring
+	buffer_t* new = pick_buffer();
 	if(!new) {
 		loggerf(ERROR, "Logic error. No free buffer.");
 		exit(1);
 	}
+	gpu_device_t* dev = new->dev;
+
+	if(new->ev_kernel) {
+		// the GPU part of the slot's last chunk is done
+		// > its callback may be late, the rate is updated with the next chunk then
+		double done;
+		__atomic_load(&new->gpu_done, &done, __ATOMIC_ACQUIRE);
+		if(hybrid_auto && new->src_size > 0 && done > 0) {
+			update_rate(&dev->rate, new->src_size, done - new->submitted);
+		}
+		if(new->ev_leaves) {
+			clReleaseEvent(new->ev_leaves);
+			new->ev_leaves = NULL;
+		}
+		clReleaseEvent(new->ev_src_unmap);
+		clReleaseEvent(new->ev_kernel);
+		new->ev_src_unmap = new->ev_kernel = NULL;
+	}
+
+	if(map_src) {
+		int err;
+		new->src = clEnqueueMapBuffer(dev->q_transfer, new->cm_src, CL_TRUE, MAP_SRC, 
+			0, bt_chunk_size, 0, NULL, NULL, &err);
+		ocl_assert(err);
+		if(src_align && (uintptr_t) new->src % src_align != 0 && !src_unaligned) {
+			loggerf(ERROR, "The mapped GPU buffers aren't aligned, direct reads go through the page cache");
+			src_unaligned = true;
+		}
+	}
+
+	STORE(&new->state, SLOT_FILLING);
+	ring[ring_tail % ring_size] = new;
+	STORE(&ring_tail, ring_tail + 1);
 
 	return new->src;
 }
 
 
+// run k after the event ev, which is replaced by the kernel's event, and
+// after the event also unless it's NULL
+// > local 0 lets the implementation choose
+static void enqueue_kernel(gpu_device_t* dev, cl_kernel k, size_t global, size_t local, 
+	cl_event* ev, cl_event also)
+{
+	cl_event done, wait[2] = { *ev, also };
+	int err = clEnqueueNDRangeKernel(dev->q_compute, k, 1, NULL, &global, local ? &local : NULL, 
+			also ? 2 : 1, wait, &done);
+	ocl_assert(err);
+	clReleaseEvent(*ev);
+	*ev = done;
+}
+
+
 void blakeTreeGPU_enqueue_src(size_t length) {
 	int err;
 
+	// the oldest acquired buffer which hasn't been enqueued yet
+	// > several buffers can be filled at once by asynchronous reads
+	if(ring_next == ring_tail) {
+		loggerf(ERROR, "Logic error. No acquired buffer.");
+		exit(1);
+	}
+	buffer_t* new = ring[ring_next % ring_size];
+	gpu_device_t* dev = new->dev;
+	ring_next++;
+
 	if(length == 0)
 	{
-		g_queue_pop_tail(bufqueue);
+		if(map_src) {
+			err = clEnqueueUnmapMemObject(dev->q_transfer, new->cm_src, new->src, 0, NULL, NULL);
+			ocl_assert(err);
+		}
+		STORE(&new->state, SLOT_EMPTY);
 		return;
 	}
 
-	size_t remainder  = length % BT_LEAF_SIZE;
-	size_t global     = length / BT_LEAF_SIZE;
-	size_t local;
-
-	// avoid invalid work group sizes, round down to % 256, extend remainder
-	if(global % 256 != 0) {
-		size_t diff = global - ((global >> 8) << 8);
-		loggerf(DEBUG, "Global work size reduced from %d to %d", global, diff);
-		global    -= diff;
-		remainder += diff * BT_LEAF_SIZE;
+	size_t leaves = length / bt_leaf_size;
+	size_t tail   = length % bt_leaf_size;
+	size_t gpu_bytes = length;
+	size_t cpu_size = 0;
+	cl_event ev;
+	uint64_t trace = trace_begin();
+
+	// hybrid: the GPU takes the first share of the leaves, in steps of 64,
+	// and the CPU the rest with the partial leaf
+	// > the CPU part is hashed below, once the GPU has its part
+	if(hybrid_share >= 0) {
+		leaves = (size_t) (hybrid_share * leaves / 64 + 0.5) * 64;
+		if(leaves > length / bt_leaf_size) {
+			leaves = length / bt_leaf_size;
+		}
+		tail = 0;
+		gpu_bytes = leaves * bt_leaf_size;
+		new->submitted = omp_get_wtime();
+		new->gpu_done = 0;
 	}
 
-	/*
-	loggerf(DEBUG, "blakeTreeGPU_enqueue_src: pending: %d  global: %d items  remainder: %d byte", 
-		blakeTreeGPU_pending(), global, remainder);
-	*/
-
-	buffer_t* new = g_queue_peek_tail(bufqueue);
-
-	if(global > 0) {
-		err = clEnqueueWriteBuffer( q_transfer,  new->cm_src, 
-			CL_FALSE, 0, FILE_BUFFER_SIZE, new->src, 0, NULL, &new->ev_src_unmap);
+	if(map_src) {
+		err = clEnqueueUnmapMemObject(dev->q_transfer, new->cm_src, new->src, 
+			0, NULL, &new->ev_src_unmap);
+	} else if(gpu_bytes > 0) {
+		err = clEnqueueWriteBuffer( dev->q_transfer,  new->cm_src, 
+			CL_FALSE, 0, gpu_bytes, new->src, 0, NULL, &new->ev_src_unmap);
+	} else {
+		// nothing for the GPU
+		new->ev_src_unmap = clCreateUserEvent(dev->context, &err);
 		ocl_assert(err);
-		
-		cl_int bt_leaf_size = BT_LEAF_SIZE;
-		err = 0;
+		err = clSetUserEventStatus(new->ev_src_unmap, CL_COMPLETE);
+	}
+	ocl_assert(err);
+	clRetainEvent(new->ev_src_unmap);
+	ev = new->ev_src_unmap;
+
+	// the first kernel writes dst, which the consumer may still be unmapping
+	cl_event dst_free = new->ev_dst_unmap;
+	new->ev_dst_unmap = NULL;
+
+	if(leaves > 0) {
+		cl_kernel kernel = dev->kernel;
+		size_t local = dev->local;
+		cl_uint leaf_size = bt_leaf_size;
+		cl_uint n = leaves;
 		err  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &new->cm_dst);
 		err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &new->cm_src);
-		err |= clSetKernelArg(kernel, 2, sizeof(cl_int), &bt_leaf_size);
+		err |= clSetKernelArg(kernel, 2, sizeof(cl_uint), &leaf_size);
+		err |= clSetKernelArg(kernel, 3, sizeof(cl_uint), &n);
 		if (err != CL_SUCCESS)
 		{
 			loggerf(ERROR, "Failed to set kernel arguments!");
 			exit(1);
 		}
-		
-		err = clGetKernelWorkGroupInfo(kernel, device_id, 
-			CL_KERNEL_WORK_GROUP_SIZE, sizeof(local), &local, NULL);
-		ocl_assert(err);
-		local = MAX(32, (local >> 8) << 8);
 
-		err = clEnqueueNDRangeKernel(q_compute, kernel, 1, NULL, &global, &local, 
-				1, &new->ev_src_unmap, &new->ev_kernel);
-		ocl_assert(err);
+		// pad the NDRange to whole work groups, the kernel skips the rest
+		enqueue_kernel(dev, kernel, ((leaves + local - 1) / local) * local, local, &ev, dst_free);
+
+		if(stats_enabled) {
+			clRetainEvent(ev);
+			new->ev_leaves = ev;
+		}
 	}
 
-	new->remainder = remainder;
-	new->global_work_items = global;
-	new->dst_size = global * HASH_LEN;
+	// the partial last leaf, with the BLAKE padding
+	if(tail > 0) {
+		cl_kernel kernel_tail = dev->kernel_tail;
+		cl_uint leaf_size = bt_leaf_size;
+		cl_uint index = leaves;
+		cl_uint inlen = tail;
+		err  = clSetKernelArg(kernel_tail, 0, sizeof(cl_mem), &new->cm_dst);
+		err |= clSetKernelArg(kernel_tail, 1, sizeof(cl_mem), &new->cm_src);
+		err |= clSetKernelArg(kernel_tail, 2, sizeof(cl_uint), &leaf_size);
+		err |= clSetKernelArg(kernel_tail, 3, sizeof(cl_uint), &index);
+		err |= clSetKernelArg(kernel_tail, 4, sizeof(cl_uint), &inlen);
+		if (err != CL_SUCCESS)
+		{
+			loggerf(ERROR, "Failed to set kernel arguments!");
+			exit(1);
+		}
+
+		enqueue_kernel(dev, kernel_tail, 1, 1, &ev, leaves > 0 ? NULL : dst_free);
+	}
+
+	new->src_size = gpu_bytes;
+	new->gpu_size = (leaves + (tail > 0)) * HASH_LEN;
+	new->dst_size = new->gpu_size + cpu_size;
+	new->level = 0;
+
+	// a full chunk: hash every fanout leaf hashes into a node
+	if(reduce_nodes && length == bt_chunk_size) {
+		cl_kernel kernel_nodes = dev->kernel_nodes;
+		size_t nodes = leaves / gpu_fanout;
+		cl_uint node_len = gpu_fanout * HASH_LEN;
+
+		err  = clSetKernelArg(kernel_nodes, 0, sizeof(cl_mem), &new->cm_nodes);
+		err |= clSetKernelArg(kernel_nodes, 1, sizeof(cl_mem), &new->cm_dst);
+		err |= clSetKernelArg(kernel_nodes, 2, sizeof(cl_uint), &node_len);
+		if (err != CL_SUCCESS)
+		{
+			loggerf(ERROR, "Failed to set kernel arguments!");
+			exit(1);
+		}
+
+		enqueue_kernel(dev, kernel_nodes, nodes, 0, &ev, NULL);
+
+		new->dst_size = new->gpu_size = nodes * HASH_LEN;
+		new->level = 1;
+	}
+
+	// without kernels nothing writes dst
+	if(dst_free) {
+		clReleaseEvent(dst_free);
+	}
+
+	// hybrid: the CPU part, while the GPU hashes the rest
+	// > src is host memory, which the write to the GPU only reads
+	if(hybrid_share >= 0) {
+		if(hybrid_auto && gpu_bytes > 0) {
+			err = clSetEventCallback(ev, CL_COMPLETE, gpu_done, new);
+			ocl_assert(err);
+		}
+		clFlush(dev->q_transfer);
+		clFlush(dev->q_compute);
+
+		if(length > gpu_bytes) {
+			blakeTreeCPU(&new->src[gpu_bytes], length - gpu_bytes, bt_leaf_size, 
+				new->cpu_dst, &cpu_size);
+			double sec = omp_get_wtime() - new->submitted;
+			if(hybrid_auto) {
+				update_rate(&rate_cpu, length - gpu_bytes, sec);
+			}
+			stats_add(STATS_CPU, sec, length - gpu_bytes);
+			new->dst_size = new->gpu_size + cpu_size;
+		}
+	}
+
+	new->ev_kernel = ev;
+	STORE(&new->state, SLOT_ENQUEUED);
+	trace_end("gpu submit", trace, gpu_bytes);
 }
 
 
-uint8_t* blakeTreeGPU_acquire_dst(size_t *dst_size) {
+uint8_t* blakeTreeGPU_acquire_dst(size_t *dst_size, int *level) {
 	int err;
 
-	if(g_queue_get_length(bufqueue) == 0) {
+	buffer_t* head;
+
+	// skip the buffers that were returned unused
+	for(;;) {
+		if(ring_head == LOAD(&ring_tail)) {
+			return NULL;
+		}
+		head = ring[ring_head % ring_size];
+		if(LOAD(&head->state) != SLOT_EMPTY) {
+			break;
+		}
+		STORE(&head->state, SLOT_FREE);
+		STORE(&ring_head, ring_head + 1);
+	}
+	if(LOAD(&head->state) != SLOT_ENQUEUED) {
 		return NULL;
 	}
 
-	buffer_t* head = g_queue_peek_head(bufqueue);
-
-	if(head->global_work_items > 0) {
-		err = clEnqueueReadBuffer(
-			q_transfer, 
-			head->cm_dst, 
-			CL_TRUE, 
-			0, 
-			STAGE1_SIZE, //head->dst_size,
-			head->dst, 
-			1, 
-			&head->ev_kernel, 
-			NULL);
+	// only the nodes cross the bus in tree mode
+	cl_mem cm = (head->level > 0) ? head->cm_nodes : head->cm_dst;
+
+	if(head->gpu_size > 0) {
+		cl_event ev;
+		uint64_t trace = trace_begin();
+		if(transfer == GPU_TRANSFER_MAP) {
+			head->dst = clEnqueueMapBuffer(head->dev->q_transfer, cm, CL_TRUE, CL_MAP_READ, 
+				0, head->gpu_size, 1, &head->ev_kernel, &ev, &err);
+		} else {
+			err = clEnqueueReadBuffer(head->dev->q_transfer, cm, CL_TRUE, 0, 
+				head->gpu_size, head->dst, 1, &head->ev_kernel, &ev);
+		}
 		ocl_assert(err);
+
+		// the whole chunk is done
+		if(stats_enabled) {
+			stats_add(STATS_WRITE, event_seconds(head->ev_src_unmap), head->src_size);
+			stats_add(STATS_KERNEL, event_span(head->ev_leaves ? head->ev_leaves : head->ev_kernel,
+				head->ev_kernel), head->src_size);
+			stats_add(STATS_READBACK, event_seconds(ev), head->gpu_size);
+		}
+		clReleaseEvent(ev);
+		trace_end("gpu readback", trace, head->gpu_size);
 	}
-	
-	if(head->remainder)
-	{
-		size_t stage1_rem;
-		blakeTreeCPU(
-			&(head->src[head->global_work_items * BT_LEAF_SIZE]), 
-			head->remainder,
-			&(head->dst[head->global_work_items * HASH_LEN]),
-			&stage1_rem);
-		head->dst_size += stage1_rem;
+
+	if(hybrid_share >= 0) {
+		if(head->gpu_size > 0) {
+			memcpy(head->out, head->dst, head->gpu_size);
+		}
+		memcpy(&head->out[head->gpu_size], head->cpu_dst, head->dst_size - head->gpu_size);
+		if(dst_size) *dst_size = head->dst_size;
+		if(level) *level = head->level;
+		return head->out;
 	}
 
 	if(dst_size) *dst_size = head->dst_size;
+	if(level) *level = head->level;
 	return head->dst;
 }
 
 
 void blakeTreeGPU_release_dst() {
-	buffer_t* head = g_queue_peek_head(bufqueue);
-	
-	head->busy = false;
-	g_queue_pop_head(bufqueue);
-	//loggerf(DEBUG, "pop_head");
+	buffer_t* head = ring[ring_head % ring_size];
+
+	// the next kernels of the slot write dst again, they wait for the unmap
+	// (see enqueue_src), the consumer doesn't
+	if(transfer == GPU_TRANSFER_MAP && head->gpu_size > 0) {
+		cl_mem cm = (head->level > 0) ? head->cm_nodes : head->cm_dst;
+		int err = clEnqueueUnmapMemObject(head->dev->q_transfer, cm, head->dst, 0, NULL, 
+			&head->ev_dst_unmap);
+		ocl_assert(err);
+		clFlush(head->dev->q_transfer);
+	}
+
+	// the events stay valid until the producer reuses the slot
+	STORE(&head->state, SLOT_FREE);
+	STORE(&ring_head, ring_head + 1);
 }
 
 
 void blakeTreeGPU_alloc_buffer(buffer_t* bp) {
 	int err;
+	cl_context context = bp->dev->context;
+
+	cl_mem_flags host;
 
-	bp->src = malloc(FILE_BUFFER_SIZE);
-	bp->dst = malloc(STAGE1_SIZE);
+	bp->src_host = NULL;
+	if(transfer == GPU_TRANSFER_MAP) {
+		bp->src = NULL;
+		bp->dst = NULL;
+		host = CL_MEM_ALLOC_HOST_PTR;
+		if(src_align || !map_src) {
+			bp->src_host = freader_alloc(bt_chunk_size);
+		}
+		if(!map_src) {
+			bp->src = bp->src_host;
+		}
+	} else {
+		// aligned for O_DIRECT reads
+		bp->src = freader_alloc(bt_chunk_size);
+		bp->dst = malloc(bt_stage1_size);
+		host = CL_MEM_USE_HOST_PTR;
+	}
 
-	bp->cm_src = clCreateBuffer(context, 
-		CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
-		FILE_BUFFER_SIZE, bp->src, &err);
+	if(map_src && bp->src_host) {
+		bp->cm_src = clCreateBuffer(context, 
+			CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
+			bt_chunk_size, bp->src_host, &err);
+	} else {
+		bp->cm_src = clCreateBuffer(context, 
+			CL_MEM_READ_ONLY | host,
+			bt_chunk_size, transfer == GPU_TRANSFER_MAP ? NULL : bp->src, &err);
+	}
 	ocl_assert(err);
 	
+	// read by the node kernel
 	bp->cm_dst = clCreateBuffer(context,
-		CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR,
-		STAGE1_SIZE, bp->dst, &err);
+		CL_MEM_READ_WRITE | host,
+		bt_stage1_size, bp->dst, &err);
 	ocl_assert(err);
+
+	bp->cm_nodes = NULL;
+	if(reduce_nodes) {
+		bp->cm_nodes = clCreateBuffer(context, 
+			CL_MEM_WRITE_ONLY | (transfer == GPU_TRANSFER_MAP ? CL_MEM_ALLOC_HOST_PTR : 0),
+			bt_stage1_size / gpu_fanout, NULL, &err);
+		ocl_assert(err);
+	}
 	
-	bp->busy = false;
+	bp->cpu_dst = bp->out = NULL;
+	if(hybrid_share >= 0) {
+		bp->cpu_dst = malloc(bt_stage1_size);
+		bp->out = malloc(bt_stage1_size);
+	}
+
+	bp->state = SLOT_FREE;
+	bp->ev_src_unmap = bp->ev_kernel = bp->ev_leaves = bp->ev_dst_unmap = NULL;
 }
 
 
 void blakeTreeGPU_free_buffer(buffer_t* bp) {
 	clReleaseMemObject(bp->cm_src);
 	clReleaseMemObject(bp->cm_dst);
-	free(bp->src);
-	free(bp->dst);
+	if(bp->cm_nodes) {
+		clReleaseMemObject(bp->cm_nodes);
+	}
+	if(bp->ev_kernel) {
+		clReleaseEvent(bp->ev_src_unmap);
+		clReleaseEvent(bp->ev_kernel);
+	}
+	if(bp->ev_leaves) {
+		clReleaseEvent(bp->ev_leaves);
+	}
+	if(bp->ev_dst_unmap) {
+		clWaitForEvents(1, &bp->ev_dst_unmap);
+		clReleaseEvent(bp->ev_dst_unmap);
+	}
+	free(bp->src_host);
+	free(bp->cpu_dst);
+	free(bp->out);
+	if(transfer == GPU_TRANSFER_COPY) {
+		free(bp->src);
+		free(bp->dst);
+	}
 }
 
 
 int blakeTreeGPU_pending()
 {
-	return g_queue_get_length(bufqueue);
+	return LOAD(&ring_tail) - LOAD(&ring_head);
 }
 
 
 int blakeTreeGPU_wait()
 {
-	if(g_queue_get_length(bufqueue) == 0) 
+	uint64_t h = LOAD(&ring_head);
+
+	if(h == LOAD(&ring_tail)) 
 	{
 		return 0;
 	}
 	else
 	{
-		buffer_t* h = g_queue_peek_head(bufqueue);
-		clWaitForEvents(1, &h->ev_kernel);
+		buffer_t* head = ring[h % ring_size];
+		if(LOAD(&head->state) == SLOT_ENQUEUED) {
+			clWaitForEvents(1, &head->ev_kernel);
+		}
 		return 1;
 	}	
 }
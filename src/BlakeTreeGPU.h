@@ -2,23 +2,73 @@
 
 #include "BlakeTree.h"
 
+#define GPU_DEFAULT_DEPTH 4
+#define GPU_MAX_DEVICES 16
 
-void blakeTreeGPU_init();
+
+// "staged" (default) or "simple", see blake256.cl
+// > returns 0 for unknown names, call before blakeTreeGPU_init()
+int blakeTreeGPU_select_kernel(const char* name);
+
+// fanout and height of the tree the results go into, see BlakeTree.h
+// > in tree mode full chunks may be reduced to level 1 nodes on the GPU
+// > depth is the number of chunk buffers in flight per device
+// > acquire_src/enqueue_src and acquire_dst/release_dst may be called
+//   from two different threads, without locking
+void blakeTreeGPU_init(int fanout, int height, int depth);
+
+// device type, see blakeTreeGPU_init(): gpu (default), cpu, accelerator, all
+// > an OpenCL CPU implementation can stand in for the GPU
+#define GPU_DEVICE_ENV "BLAKETREE_CL_DEVICE"
+
+// work-group size of the simple leaf kernel, 0 (default) lets the device
+// choose, the staged kernel always uses its own
+// > sizes the device can't run are ignored
+// > call before blakeTreeGPU_init()
+void blakeTreeGPU_set_local(size_t local);
+
+// devices to use: "all" (default) or indices like "0,2", in the order the
+// platforms list them (logged by blakeTreeGPU_init())
+// > chunks go to the least busy device and come back in order
+// > returns 0 if list is invalid, call before blakeTreeGPU_init()
+int blakeTreeGPU_select_devices(const char* list);
+
+// hash a share of the leaves of every chunk on the CPU, in parallel with
+// the GPU: "auto" adapts the share to the measured throughput, a number
+// between 0 and 1 is the fixed GPU share, NULL turns it off
+// > returns 0 if arg is invalid, call before blakeTreeGPU_init()
+int blakeTreeGPU_set_hybrid(const char* arg);
+
+// align the buffers acquire_src() returns for O_DIRECT reads
+// > call before blakeTreeGPU_init()
+void blakeTreeGPU_align_src(size_t align);
+
+// names and drivers of the devices blakeTreeGPU_init() would use, for
+// telling machines apart (see profile.h)
+void blakeTreeGPU_identity(char* buf, size_t size);
+
+// "map" (default) or "copy", see BlakeTreeGPU.c
+// > returns 0 for unknown names, call before blakeTreeGPU_init()
+int blakeTreeGPU_select_transfer(const char* name);
 
 void blakeTreeGPU_close();
 
 // request a new buffer
-// > if the queue is full, block until the head is done, return NULL
+// > if the ring is full, block until the head is done, return NULL
 // > else initialize the buffer, return its address
 uint8_t* blakeTreeGPU_acquire_src();
 
-// add the most recently acquired buffer to the command queue
+// add the oldest acquired buffer to the command queue
+// > buffers may be acquired ahead and filled asynchronously, they are
+//   enqueued in the order they were acquired
+// > a length of 0 returns the buffer unused
 void     blakeTreeGPU_enqueue_src(size_t length); 
 
 // fetch a completed buffer
-// > returns NULL if the queue is empty
+// > returns NULL if the ring is empty or its head isn't enqueued yet
 // > blocks and returns the head buffer otherwise
-uint8_t* blakeTreeGPU_acquire_dst(size_t *dst_size); 
+// > level is the tree level of the hashes, see blakeTree_update_level()
+uint8_t* blakeTreeGPU_acquire_dst(size_t *dst_size, int *level); 
 
 // release the output buffer
 void     blakeTreeGPU_release_dst(); 
@@ -0,0 +1,312 @@
+#include "BlakeTreePipeline.h"
+#include "BlakeTreeCPU.h"
+#include "log.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+// every chunk passes its slot through
+// FREE -> READING -> READ -> HASHING -> HASHED -> FREE
+enum slot_state {
+	SLOT_FREE, SLOT_READING, SLOT_READ, SLOT_HASHING, SLOT_HASHED
+};
+
+typedef struct {
+	enum slot_state state;
+	int64_t seq;             // chunk number, slot = seq % depth
+	uint8_t* buf;            // NULL for mapped input
+	const uint8_t* window;   // chunk data, points to buf or into the mapping
+	size_t length;           // 0 marks the end of the input
+	uint8_t* dst;
+	size_t dst_size;
+} slot_t;
+
+typedef struct {
+	freader_t* reader;
+	slot_t* slots;
+	int depth;
+	int readers;
+
+	uint64_t next_seq;       // next chunk to be claimed by a reader
+	uint64_t eof_seq;        // chunk number of the end marker, if positional
+
+	blakeTree_t* tree;
+	bool master_done;
+
+	// nodes the master stage waits for, hashed by the leaf stage
+	// > count 0: nothing to do
+	uint8_t* nodes_out;
+	const uint8_t* nodes_in;
+	size_t nodes_count;
+	size_t nodes_len;
+
+	// one lock for all slot states, they only change a few times per chunk
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+} pipeline_t;
+
+
+static void set_slot(pipeline_t* p, slot_t* s, enum slot_state state)
+{
+	pthread_mutex_lock(&p->lock);
+	s->state = state;
+	pthread_cond_broadcast(&p->changed);
+	pthread_mutex_unlock(&p->lock);
+}
+
+
+// touch every page so the disk reads happen on the reader threads
+static void prefault(const uint8_t* window, size_t length)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	// volatile keeps the compiler from dropping the reads
+	for(size_t off = 0; off < length; off += page) {
+		(void) *(volatile const uint8_t*) &window[off];
+	}
+}
+
+
+static void* reader_stage(void* arg)
+{
+	pipeline_t* p = arg;
+	slot_t* s;
+	uint64_t seq;
+	size_t length;
+
+	trace_thread_name("reader");
+	for(;;) {
+		// claim the next chunk and wait until its slot has been consumed
+		pthread_mutex_lock(&p->lock);
+		seq = p->next_seq;
+		if(p->readers > 1 && seq > p->eof_seq) {
+			pthread_mutex_unlock(&p->lock);
+			return NULL;
+		}
+		p->next_seq++;
+		s = &p->slots[seq % p->depth];
+		double start = stats_now();
+		while(s->state != SLOT_FREE || s->seq + p->depth != seq) {
+			pthread_cond_wait(&p->changed, &p->lock);
+		}
+		s->seq = seq;
+		s->state = SLOT_READING;
+		pthread_mutex_unlock(&p->lock);
+		stats_add(STATS_STALL, stats_now() - start, 0);
+
+		start = stats_now();
+		uint64_t trace = trace_begin();
+
+		if(p->readers > 1) {
+			length = freader_pread(p->reader, s->buf, bt_chunk_size, 
+				seq * bt_chunk_size, &s->window);
+		} else {
+			length = freader_next(p->reader, s->buf, bt_chunk_size, &s->window);
+		}
+		if(p->reader->mode == FREADER_MMAP) {
+			prefault(s->window, length);
+		}
+		if(length) {
+			stats_add(STATS_READ, stats_now() - start, length);
+		}
+		trace_end("read", trace, length);
+		s->length = length;
+		set_slot(p, s, SLOT_READ);
+
+		if(p->readers == 1 && length == 0) {
+			return NULL;
+		}
+	}
+}
+
+
+// blakeTree_t.hash_nodes of the master stage
+// > a few nodes are hashed right away, the rest waits for the leaf stage
+static void queue_nodes(void* arg, uint8_t* out, const uint8_t* in, size_t count,
+	size_t node_len)
+{
+	pipeline_t* p = arg;
+
+	if(count < 2 * BLAKE256_LEAF_LANES) {
+		blakeTree_hash_nodes(out, in, count, node_len);
+		return;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	p->nodes_out   = out;
+	p->nodes_in    = in;
+	p->nodes_len   = node_len;
+	p->nodes_count = count;
+	pthread_cond_broadcast(&p->changed);
+	while(p->nodes_count) {
+		pthread_cond_wait(&p->changed, &p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+
+// hash the queued nodes on the leaf stage, with the lock held
+static void hash_queued_nodes(pipeline_t* p)
+{
+	pthread_mutex_unlock(&p->lock);
+	blakeTree_hash_nodes(p->nodes_out, p->nodes_in, p->nodes_count, p->nodes_len);
+	pthread_mutex_lock(&p->lock);
+	p->nodes_count = 0;
+	pthread_cond_broadcast(&p->changed);
+}
+
+
+static void* master_stage(void* arg)
+{
+	pipeline_t* p = arg;
+	slot_t* s;
+	uint64_t seq;
+
+	trace_thread_name("master");
+	for(seq = 0; ; seq++) {
+		s = &p->slots[seq % p->depth];
+		pthread_mutex_lock(&p->lock);
+		while(s->state != SLOT_HASHED) {
+			pthread_cond_wait(&p->changed, &p->lock);
+		}
+		pthread_mutex_unlock(&p->lock);
+
+		if(s->length == 0) {
+			pthread_mutex_lock(&p->lock);
+			p->master_done = true;
+			pthread_cond_broadcast(&p->changed);
+			pthread_mutex_unlock(&p->lock);
+			return NULL;
+		}
+		double start = stats_now();
+		blakeTree_update(p->tree, s->dst, s->dst_size);
+		stats_add(STATS_MASTER, stats_now() - start, s->length);
+		set_slot(p, s, SLOT_FREE);
+	}
+}
+
+
+// the oldest chunk that has been read
+// > the master stage's nodes go first, it frees the slots
+static slot_t* wait_read(pipeline_t* p)
+{
+	slot_t* s = NULL;
+
+	pthread_mutex_lock(&p->lock);
+	while(!s) {
+		if(p->nodes_count) {
+			hash_queued_nodes(p);
+			continue;
+		}
+		for(int i=0; i < p->depth; i++) {
+			if(p->slots[i].state == SLOT_READ && (!s || p->slots[i].seq < s->seq)) {
+				s = &p->slots[i];
+			}
+		}
+		if(!s) {
+			pthread_cond_wait(&p->changed, &p->lock);
+		}
+	}
+	s->state = SLOT_HASHING;
+	pthread_mutex_unlock(&p->lock);
+	return s;
+}
+
+
+uint64_t blakeTreePipeline_run(freader_t* r, int depth, int readers, blakeTree_t* tree)
+{
+	pipeline_t p;
+	pthread_t reader_threads[readers], master;
+	uint64_t total = 0;
+	uint64_t hashed, eof_seq;
+	bool eof;
+	size_t length;
+	slot_t* s;
+
+	// positional reads need to know where the file ends
+	if(readers > 1 && r->size == 0) {
+		loggerf(DEBUG, "Input size unknown, using a single reader");
+		readers = 1;
+	}
+
+	p.reader = r;
+	p.depth = depth;
+	p.readers = readers;
+	p.next_seq = 0;
+	p.eof_seq = (r->size + bt_chunk_size - 1) / bt_chunk_size;
+	p.tree = tree;
+	p.master_done = false;
+	p.nodes_count = 0;
+	tree->hash_nodes = queue_nodes;
+	tree->hash_nodes_arg = &p;
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_cond_init(&p.changed, NULL);
+
+	p.slots = calloc(depth, sizeof(slot_t));
+	for(int i=0; i < depth; i++) {
+		p.slots[i].state = SLOT_FREE;
+		p.slots[i].seq = i - depth;
+		p.slots[i].buf = (r->mode == FREADER_MMAP) ? NULL : freader_alloc(bt_chunk_size);
+		p.slots[i].dst = malloc(bt_stage1_size);
+	}
+
+	for(int i=0; i < readers; i++) {
+		pthread_create(&reader_threads[i], NULL, reader_stage, &p);
+	}
+	pthread_create(&master, NULL, master_stage, &p);
+
+	// leaf stage
+	// > chunks may complete out of order, the master stage restores it
+	// > the slot belongs to the other stages after set_slot()
+	hashed = eof_seq = 0;
+	eof = false;
+	while(!eof || hashed < eof_seq) {
+		double start = stats_now();
+		s = wait_read(&p);
+		stats_add(STATS_IDLE, stats_now() - start, 0);
+		length = s->length;
+		if(length) {
+			start = stats_now();
+			blakeTreeCPU(s->window, length, bt_leaf_size, s->dst, &s->dst_size);
+			stats_add(STATS_CPU, stats_now() - start, length);
+			total += length;
+			hashed++;
+		} else {
+			eof = true;
+			eof_seq = s->seq;
+		}
+		set_slot(&p, s, SLOT_HASHED);
+	}
+
+	// the master stage still adds the last chunks
+	pthread_mutex_lock(&p.lock);
+	while(!p.master_done) {
+		if(p.nodes_count) {
+			hash_queued_nodes(&p);
+		} else {
+			pthread_cond_wait(&p.changed, &p.lock);
+		}
+	}
+	pthread_mutex_unlock(&p.lock);
+	tree->hash_nodes = NULL;
+	tree->hash_nodes_arg = NULL;
+
+	for(int i=0; i < readers; i++) {
+		pthread_join(reader_threads[i], NULL);
+	}
+	pthread_join(master, NULL);
+
+	for(int i=0; i < depth; i++) {
+		free(p.slots[i].buf);
+		free(p.slots[i].dst);
+	}
+	free(p.slots);
+	pthread_mutex_destroy(&p.lock);
+	pthread_cond_destroy(&p.changed);
+
+	return total;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "BlakeTree.h"
+#include "file-reader.h"
+
+#define PIPELINE_DEFAULT_DEPTH 4
+
+// Hashes the whole input on the CPU with three overlapping stages:
+// > reader threads: fill the next chunks (fault them in for mapped files)
+// > calling thread: leaf hashing with blakeTreeCPU, in completion order
+// > master thread:  adds the stage 1 hashes to tree, in file order
+// The complete nodes of the tree levels are hashed by the leaf stage's
+// OpenMP team between two chunks, so the stages never compete for cores.
+// depth is the number of chunks in flight, readers > 1 reads several
+// chunks of a regular file concurrently with positional reads.
+// Returns the number of bytes hashed.
+uint64_t blakeTreePipeline_run(freader_t* r, int depth, int readers, blakeTree_t* tree);
@@ -0,0 +1,471 @@
+// Cycles per byte of every BLAKE-256 backend and of the CPU tree hashing
+//
+// Like SUPERCOP, every measurement is the median of several samples, each
+// long enough for the cycle counter to be meaningful. The results go to
+// stdout as CSV, one line per measurement:
+//
+//   bench,impl,bytes,leaf,threads,samples,cycles_per_byte,mib_per_s,efficiency
+//
+// > hash:   blake256_hash() of one message
+// > leaves: blake256_hash_leaves(), one multi-buffer batch of leaves
+// > tree:   blakeTreeCPU() with OpenMP, efficiency is the speedup over one
+//           thread divided by the number of threads
+//
+// -g benchmarks the GPU pipeline instead, see bench_gpu().
+#define _POSIX_C_SOURCE 200809L
+
+#include "BlakeTreeCPU.h"
+#include "BlakeTreeGPU.h"
+#include "log.h"
+#include "stats.h"
+#include "workload.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <omp.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#define BENCH_MAX_LIST 32
+#define BENCH_SAMPLES 15
+#define BENCH_SAMPLES_LARGE 3          // above 1 MiB
+#define BENCH_SAMPLE_BYTES (1 << 20)   // small messages are repeated
+
+static const size_t hash_sizes[] = { 1, 8, 64, 576, 1536, 4096, 1 << 16, 1 << 20,
+	1 << 24, 1 << 28, 0 };
+static const size_t tree_sizes[] = { 1 << 16, 1 << 20, 1 << 23, 1 << 26, 1 << 28, 0 };
+
+static size_t max_size = 1 << 28;
+static size_t leaf_sizes[BENCH_MAX_LIST] = { 1024, 2048, 4096, 8192 };
+static int num_leaf_sizes = 4;
+static int threads[BENCH_MAX_LIST];
+static int num_threads;
+static const char* only_impl;
+
+// GPU pipeline
+static bool gpu_mode;
+static size_t chunk_sizes[BENCH_MAX_LIST] = { 1 << 20, 1 << 23, 1 << 25 };
+static int num_chunk_sizes = 3;
+static size_t depths[BENCH_MAX_LIST] = { 2, 4, 8 };
+static int num_depths = 3;
+static size_t locals[BENCH_MAX_LIST] = { 0, 64, 128, 256 };
+static int num_locals = 4;
+static const char* gpu_kernel_names[] = { "staged", "simple", NULL };
+static const char* only_kernel;
+static const char* transfer_name = "map";
+
+
+void usage() {
+	fprintf(stderr, "Usage: blaketree-bench [-b impl] [-M max] [-L leaf,...] [-j threads,...]\n");
+	fprintf(stderr, "       blaketree-bench -g [-M bytes] [-L leaf,...] [-S chunk,...] [-q depth,...]\n");
+	fprintf(stderr, "                          [-w local,...] [-k kernel] [-m transfer]\n");
+	fprintf(stderr, "  -b   Only this CPU implementation (default: all supported)\n");
+	fprintf(stderr, "  -M   Largest message in bytes, k/m/g suffixes (default: 256m)\n");
+	fprintf(stderr, "       GPU: bytes hashed per configuration\n");
+	fprintf(stderr, "  -L   Leaf sizes of the leaves, tree and GPU benchmarks (default: 1k,2k,4k,8k)\n");
+	fprintf(stderr, "  -j   Thread counts of the tree benchmark (default: powers of two up to %d)\n",
+		omp_get_max_threads());
+	fprintf(stderr, "  -g   Benchmark the GPU pipeline, the device type is set by %s\n",
+		GPU_DEVICE_ENV);
+	fprintf(stderr, "  -S   GPU chunk sizes (default: 1m,8m,32m)\n");
+	fprintf(stderr, "  -q   GPU buffers in flight per device (default: 2,4,8)\n");
+	fprintf(stderr, "  -w   Work-group sizes of the simple kernel, 0 lets the device choose\n");
+	fprintf(stderr, "       (default: 0,64,128,256)\n");
+	fprintf(stderr, "  -k   Only this GPU leaf kernel: staged, simple (default: both)\n");
+	fprintf(stderr, "  -m   GPU transfers: map, copy (default: map)\n");
+	exit(EXIT_FAILURE);
+}
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// the TSC counts at a fixed rate, which is what SUPERCOP reports on x86
+// > elsewhere nanoseconds stand in for cycles
+static uint64_t cycles(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return now_ns();
+#endif
+}
+
+
+// comma separated sizes, returns the count or 0 on errors
+static int parse_list(const char* s, size_t* out)
+{
+	int n = 0;
+	char buf[256];
+
+	snprintf(buf, sizeof(buf), "%s", s);
+	for(char* tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+		if(n == BENCH_MAX_LIST || !(out[n++] = blakeTree_parse_size(tok))) {
+			return 0;
+		}
+	}
+	return n;
+}
+
+
+typedef struct {
+	const uint8_t* in;
+	uint8_t* out;
+	size_t bytes;
+	size_t leaf;
+} job_t;
+
+typedef void (*bench_fn)(const job_t* job);
+
+static void run_hash(const job_t* job)
+{
+	blake256_hash(job->out, job->in, job->bytes);
+}
+
+static void run_leaves(const job_t* job)
+{
+	blake256_hash_leaves(job->out, job->in, job->leaf);
+}
+
+static void run_tree(const job_t* job)
+{
+	size_t out_size;
+	blakeTreeCPU(job->in, job->bytes, job->leaf, job->out, &out_size);
+}
+
+
+static int compare_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+	return (x > y) - (x < y);
+}
+
+
+// median cycles and nanoseconds per byte
+static void measure(bench_fn fn, const job_t* job, double* cpb, double* nspb, int* samples)
+{
+	uint64_t c[BENCH_SAMPLES], t[BENCH_SAMPLES];
+	size_t reps = (job->bytes < BENCH_SAMPLE_BYTES) ? BENCH_SAMPLE_BYTES / job->bytes : 1;
+	int n = (job->bytes > (1 << 20)) ? BENCH_SAMPLES_LARGE : BENCH_SAMPLES;
+
+	fn(job);  // warm up caches, pages and threads
+
+	for(int s=0; s < n; s++) {
+		uint64_t t0 = now_ns(), c0 = cycles();
+		for(size_t r=0; r < reps; r++) {
+			fn(job);
+		}
+		c[s] = cycles() - c0;
+		t[s] = now_ns() - t0;
+	}
+	qsort(c, n, sizeof(uint64_t), compare_u64);
+	qsort(t, n, sizeof(uint64_t), compare_u64);
+
+	*cpb  = (double) c[n / 2] / (reps * job->bytes);
+	*nspb = (double) t[n / 2] / (reps * job->bytes);
+	*samples = n;
+}
+
+
+static void report(const char* bench, const char* impl, const job_t* job, int nthreads,
+	double cpb, double nspb, int samples, double efficiency)
+{
+	printf("%s,%s,%zu,%zu,%d,%d,%.2f,%.1f,", bench, impl, job->bytes, job->leaf,
+		nthreads, samples, cpb, 1e9 / nspb / 1048576);
+	if(efficiency > 0) {
+		printf("%.2f\n", efficiency);
+	} else {
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
+
+static void bench_hash(const blake256_impl_t* impl, job_t* job)
+{
+	double cpb, nspb;
+	int samples;
+
+	job->leaf = 0;
+	for(int i=0; hash_sizes[i] && hash_sizes[i] <= max_size; i++) {
+		job->bytes = hash_sizes[i];
+		measure(run_hash, job, &cpb, &nspb, &samples);
+		report("hash", impl->name, job, 1, cpb, nspb, samples, 0);
+	}
+}
+
+
+static void bench_leaves(const blake256_impl_t* impl, job_t* job)
+{
+	double cpb, nspb;
+	int samples;
+
+	for(int l=0; l < num_leaf_sizes; l++) {
+		job->leaf  = leaf_sizes[l];
+		job->bytes = impl->leaf_lanes * leaf_sizes[l];
+		if(job->bytes > max_size) {
+			continue;
+		}
+		measure(run_leaves, job, &cpb, &nspb, &samples);
+		report("leaves", impl->name, job, 1, cpb, nspb, samples, 0);
+	}
+}
+
+
+static void bench_tree(const blake256_impl_t* impl, job_t* job)
+{
+	double cpb, nspb, single;
+	int samples, restore = omp_get_max_threads();
+
+	for(int l=0; l < num_leaf_sizes; l++) {
+		job->leaf = leaf_sizes[l];
+		for(int i=0; tree_sizes[i] && tree_sizes[i] <= max_size; i++) {
+			job->bytes = tree_sizes[i];
+			if(job->bytes < job->leaf) {
+				continue;
+			}
+			single = 0;
+			for(int t=0; t < num_threads; t++) {
+				omp_set_num_threads(threads[t]);
+				measure(run_tree, job, &cpb, &nspb, &samples);
+				if(threads[t] == 1) {
+					single = cpb;
+				}
+				report("tree", impl->name, job, threads[t], cpb, nspb, samples,
+					single > 0 ? single / (cpb * threads[t]) : 0);
+			}
+		}
+	}
+	omp_set_num_threads(restore);
+}
+
+
+static double mib_s(uint64_t bytes, double sec)
+{
+	return sec > 0 ? bytes / 1048576.0 / sec : 0;
+}
+
+
+// the GPU pipeline for every kernel, work-group size, leaf size, chunk size
+// and ring depth
+// > kernel, write and readback come from OpenCL event profiling (see
+//   stats.h), end to end is the wall time including the host copies
+static void bench_gpu(const uint8_t* data)
+{
+	double wall, host, sec;
+	uint64_t bytes;
+
+	printf("bench,kernel,transfer,leaf,chunk,depth,local,bytes,"
+		"end_to_end_mib_s,kernel_mib_s,write_mib_s,readback_mib_s,host_mib_s\n");
+	stats_enabled = true;
+
+	for(int k=0; gpu_kernel_names[k]; k++) {
+		const char* kernel = gpu_kernel_names[k];
+		if(only_kernel && strcmp(only_kernel, kernel) != 0) {
+			continue;
+		}
+		blakeTreeGPU_select_kernel(kernel);
+
+		// the staged kernel has a fixed work-group size, it runs once
+		bool staged = strcmp(kernel, "staged") == 0;
+		for(int w=0; w < (staged ? 1 : num_locals); w++) {
+			size_t local = staged ? 0 : locals[w];
+			blakeTreeGPU_set_local(local);
+
+			for(int l=0; l < num_leaf_sizes; l++) {
+				for(int c=0; c < num_chunk_sizes; c++) {
+					if(!blakeTree_set_geometry(leaf_sizes[l], chunk_sizes[c])) {
+						continue;
+					}
+					size_t total = (max_size / bt_chunk_size) * bt_chunk_size;
+					if(total == 0) {
+						total = bt_chunk_size;
+					}
+
+					for(int d=0; d < num_depths; d++) {
+						blakeTreeGPU_init(0, 0, depths[d]);
+
+						// builds, first touch of the buffers
+						workload_gpu_pass(data, depths[d] * bt_chunk_size, NULL);
+						stats_reset();
+						wall = workload_gpu_pass(data, total, &host);
+						blakeTreeGPU_close();
+
+						printf("gpu,%s,%s,%zu,%zu,%zu,%zu,%zu,%.1f,", kernel, transfer_name,
+							bt_leaf_size, bt_chunk_size, depths[d], local, total,
+							mib_s(total, wall));
+						stats_total(STATS_KERNEL, &sec, &bytes);
+						printf("%.1f,", mib_s(bytes, sec));
+						stats_total(STATS_WRITE, &sec, &bytes);
+						printf("%.1f,", mib_s(bytes, sec));
+						stats_total(STATS_READBACK, &sec, &bytes);
+						printf("%.1f,", mib_s(bytes, sec));
+						printf("%.1f\n", mib_s(total, host));
+						fflush(stdout);
+					}
+				}
+			}
+		}
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	size_t list[BENCH_MAX_LIST];
+	int opt, n;
+
+	while ((opt = getopt(argc, argv, "hgb:M:L:j:S:q:w:k:m:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'b':
+			only_impl = optarg;
+			if(!blake256_select_impl(optarg)) {
+				loggerf(ERROR, "CPU implementation \"%s\" is unknown or not supported",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'M':
+			max_size = blakeTree_parse_size(optarg);
+			if(max_size == 0) {
+				usage();
+			}
+			break;
+		case 'L':
+			num_leaf_sizes = parse_list(optarg, leaf_sizes);
+			for(int l=0; l < num_leaf_sizes; l++) {
+				if(leaf_sizes[l] % 64 != 0) {
+					usage();
+				}
+			}
+			if(num_leaf_sizes == 0) {
+				usage();
+			}
+			break;
+		case 'j':
+			n = parse_list(optarg, list);
+			if(n == 0) {
+				usage();
+			}
+			for(num_threads = 0; num_threads < n; num_threads++) {
+				threads[num_threads] = list[num_threads];
+			}
+			break;
+		case 'g':
+			gpu_mode = true;
+			break;
+		case 'S':
+			num_chunk_sizes = parse_list(optarg, chunk_sizes);
+			if(num_chunk_sizes == 0) {
+				usage();
+			}
+			break;
+		case 'q':
+			num_depths = parse_list(optarg, depths);
+			if(num_depths == 0) {
+				usage();
+			}
+			break;
+		case 'w':
+			// 0 is valid here
+			num_locals = 0;
+			for(char* tok = strtok(optarg, ","); tok; tok = strtok(NULL, ",")) {
+				if(num_locals == BENCH_MAX_LIST) {
+					usage();
+				}
+				locals[num_locals++] = strtoul(tok, NULL, 10);
+			}
+			if(num_locals == 0) {
+				usage();
+			}
+			break;
+		case 'k':
+			if(!blakeTreeGPU_select_kernel(optarg)) {
+				usage();
+			}
+			only_kernel = optarg;
+			break;
+		case 'm':
+			if(!blakeTreeGPU_select_transfer(optarg)) {
+				usage();
+			}
+			transfer_name = optarg;
+			break;
+		default: /* '?' */
+			usage();
+		}
+	}
+
+	if(num_threads == 0) {
+		int max = omp_get_max_threads();
+		for(int t=1; t < max && num_threads < BENCH_MAX_LIST - 1; t *= 2) {
+			threads[num_threads++] = t;
+		}
+		threads[num_threads++] = max;
+	}
+
+	// the largest message, or a batch of the largest leaves
+	// > GPU: one chunk
+	size_t buf_size = gpu_mode ? 0 : max_size;
+	for(int l=0; l < num_leaf_sizes; l++) {
+		if(buf_size < 16 * leaf_sizes[l]) {
+			buf_size = 16 * leaf_sizes[l];
+		}
+	}
+	for(int c=0; gpu_mode && c < num_chunk_sizes; c++) {
+		if(buf_size < chunk_sizes[c]) {
+			buf_size = chunk_sizes[c];
+		}
+	}
+	job_t job;
+	uint8_t* in = workload_alloc(buf_size);
+	job.in  = in;
+	job.out = malloc((buf_size / 64 + 1) * HASH_LEN);
+	if(!job.out) {
+		loggerf(ERROR, "Out of memory");
+		exit(1);
+	}
+
+	if(gpu_mode) {
+		bench_gpu(in);
+		free(in);
+		free(job.out);
+		return 0;
+	}
+
+#ifndef HAVE_TSC
+	loggerf(ERROR, "No cycle counter, cycles_per_byte are nanoseconds per byte");
+#endif
+
+	printf("bench,impl,bytes,leaf,threads,samples,cycles_per_byte,mib_per_s,efficiency\n");
+
+	const blake256_impl_t* best = blake256_impl;
+	for(const blake256_impl_t *impl = blake256_impls; impl->name; impl++) {
+		if(!impl->supported() || (only_impl && impl != best)) {
+			continue;
+		}
+		blake256_impl = impl;
+		bench_hash(impl, &job);
+		bench_leaves(impl, &job);
+		bench_tree(impl, &job);
+	}
+	blake256_impl = best;
+
+	free(in);
+	free(job.out);
+	return 0;
+}
@@ -44,39 +44,75 @@ void blake256_ref_compress( state256 *S, const uint8_t *block );
 void blake256_ref_update( state256 *S, const uint8_t *in, uint64_t inlen );
 void blake256_ref_final( state256 *S, uint8_t *out );
 void blake256_ref_hash( uint8_t *out, const uint8_t *in, uint64_t inlen );
+void blake256_ref_hash_leaf( uint8_t *out, const uint8_t *in, uint64_t inlen );
 
 
-#ifdef __SSSE3__
-	void blake256_ssse3_init( state256 *S );
-	void blake256_ssse3_compress( state256 *state, const uint8_t *block );
-	void blake256_ssse3_update( state256 *S, const uint8_t *data, uint64_t inlen );
-	void blake256_ssse3_final( state256 *S, uint8_t *digest );
-	void blake256_ssse3_hash( uint8_t *out, const uint8_t *in, uint64_t inlen );
-	#define BLAKE256_CPU_IMPL "SSSE3"
-	#define blake256_init     blake256_ssse3_init
-	#define blake256_compress blake256_ssse3_compress
-	#define blake256_update   blake256_ssse3_update
-	#define blake256_final    blake256_ssse3_final
-	#define blake256_hash     blake256_ssse3_hash
-#else
-	#ifdef __SSE2__
-		void blake256_sse2_init( state256 *S );
-		void blake256_sse2_compress( state256 *state, const uint8_t *block );
-		void blake256_sse2_update( state256 *S, const uint8_t *data, uint64_t inlen );
-		void blake256_sse2_final( state256 *S, uint8_t *digest );
-		void blake256_sse2_hash( uint8_t *out, const uint8_t *in, uint64_t inlen );
-		#define BLAKE256_CPU_IMPL "SSE2"
-		#define blake256_init     blake256_sse2_init
-		#define blake256_compress blake256_sse2_compress
-		#define blake256_update   blake256_sse2_update
-		#define blake256_final    blake256_sse2_final
-		#define blake256_hash     blake256_sse2_hash
-	#else
-		#define BLAKE256_CPU_IMPL "C"
-		#define blake256_init     blake256_ref_init
-		#define blake256_compress blake256_ref_compress
-		#define blake256_update   blake256_ref_update
-		#define blake256_final    blake256_ref_final
-		#define blake256_hash     blake256_ref_hash
-	#endif
-#endif
+// SSE2 implementation
+void blake256_sse2_init( state256 *S );
+void blake256_sse2_compress( state256 *state, const uint8_t *block );
+void blake256_sse2_update( state256 *S, const uint8_t *data, uint64_t inlen );
+void blake256_sse2_final( state256 *S, uint8_t *digest );
+void blake256_sse2_hash( uint8_t *out, const uint8_t *in, uint64_t inlen );
+void blake256_sse2_hash_leaf( uint8_t *out, const uint8_t *in, uint64_t inlen );
+
+
+// SSSE3 implementation
+void blake256_ssse3_init( state256 *S );
+void blake256_ssse3_compress( state256 *state, const uint8_t *block );
+void blake256_ssse3_update( state256 *S, const uint8_t *data, uint64_t inlen );
+void blake256_ssse3_final( state256 *S, uint8_t *digest );
+void blake256_ssse3_hash( uint8_t *out, const uint8_t *in, uint64_t inlen );
+void blake256_ssse3_hash_leaf( uint8_t *out, const uint8_t *in, uint64_t inlen );
+
+
+// Multi-buffer leaf hashing
+// > hashes LANES consecutive messages of equal length at once
+void blake256_avx2_hash8( uint8_t *out, const uint8_t *in, uint64_t inlen );
+void blake256_avx512_hash16( uint8_t *out, const uint8_t *in, uint64_t inlen );
+
+
+// Runtime dispatch
+// > every implementation is compiled into the binary, the fastest one the
+//   CPU supports is picked at startup (see blake256-dispatch.c)
+typedef struct
+{
+  const char *name;
+  int  (*supported)( void );
+  void (*init)( state256 *S );
+  void (*compress)( state256 *S, const uint8_t *block );
+  void (*update)( state256 *S, const uint8_t *in, uint64_t inlen );
+  void (*final)( state256 *S, uint8_t *out );
+  void (*hash)( uint8_t *out, const uint8_t *in, uint64_t inlen );
+  void (*hash_leaf)( uint8_t *out, const uint8_t *in, uint64_t inlen );
+  void (*hash_leaves)( uint8_t *out, const uint8_t *in, uint64_t inlen );
+  int  leaf_lanes;
+} blake256_impl_t;
+
+// fastest first, terminated by an entry without name
+extern const blake256_impl_t blake256_impls[];
+
+extern const blake256_impl_t *blake256_impl;
+
+// name == NULL or "auto" selects the fastest supported implementation
+// > returns 0 if the implementation is unknown or not supported by the CPU
+int blake256_select_impl( const char *name );
+
+// the entry of impls blake256_select_impl() would pick, NULL if none
+const blake256_impl_t *blake256_find_impl( const blake256_impl_t *impls, const char *name );
+
+#define BLAKE256_IMPL_ENV "BLAKETREE_IMPL"
+
+#define BLAKE256_CPU_IMPL    (blake256_impl->name)
+#define BLAKE256_LEAF_LANES  (blake256_impl->leaf_lanes)
+
+#define blake256_init(S)                blake256_impl->init( S )
+#define blake256_compress(S, block)     blake256_impl->compress( S, block )
+#define blake256_update(S, in, inlen)   blake256_impl->update( S, in, inlen )
+#define blake256_final(S, out)          blake256_impl->final( S, out )
+#define blake256_hash(out, in, inlen)   blake256_impl->hash( out, in, inlen )
+
+// same result as blake256_hash, faster for multiples of 64 bytes (leaves)
+#define blake256_hash_leaf(out, in, inlen) blake256_impl->hash_leaf( out, in, inlen )
+
+// hashes BLAKE256_LEAF_LANES consecutive messages of equal length at once
+#define blake256_hash_leaves(out, in, inlen) blake256_impl->hash_leaves( out, in, inlen )
@@ -0,0 +1,255 @@
+// Blake-256, AVX2 multi-buffer
+//
+// Hashes 8 messages of equal length at once, one message per 32-bit lane.
+// The message blocks are transposed on load, so all lanes share the round
+// schedule and the padding layout. Used for the tree leaves, which are
+// independent and (except for the tail) all leaf size bytes long.
+
+#include "blake.h"
+
+#ifdef __AVX2__
+
+#include <immintrin.h>
+
+#define LANES 8
+
+static const uint8_t sig[14][16] =
+{
+  { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,15 },
+  {14,10, 4, 8, 9,15,13, 6, 1,12, 0, 2,11, 7, 5, 3 },
+  {11, 8,12, 0, 5, 2,15,13,10,14, 3, 6, 7, 1, 9, 4 },
+  { 7, 9, 3, 1,13,12,11,14, 2, 6, 5,10, 4, 0,15, 8 },
+  { 9, 0, 5, 7, 2, 4,10,15,14, 1,11,12, 6, 8, 3,13 },
+  { 2,12, 6,10, 0,11, 8, 3, 4,13, 7, 5,15,14, 1, 9 },
+  {12, 5, 1,15,14,13, 4,10, 0, 7, 6, 3, 9, 2, 8,11 },
+  {13,11, 7,14,12, 1, 3, 9, 5, 0,15, 4, 8, 6, 2,10 },
+  { 6,15,14, 9,11, 3, 0, 8,12, 2,13, 7, 1, 4,10, 5 },
+  {10, 2, 8, 4, 7, 6, 1, 5,15,11, 9,14, 3,12,13 ,0 },
+  { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,15 },
+  {14,10, 4, 8, 9,15,13, 6, 1,12, 0, 2,11, 7, 5, 3 },
+  {11, 8,12, 0, 5, 2,15,13,10,14, 3, 6, 7, 1, 9, 4 },
+  { 7, 9, 3, 1,13,12,11,14, 2, 6, 5,10, 4, 0,15, 8 }
+};
+
+static const uint32_t z[16] =
+{
+  0x243F6A88, 0x85A308D3, 0x13198A2E, 0x03707344,
+  0xA4093822, 0x299F31D0, 0x082EFA98, 0xEC4E6C89,
+  0x452821E6, 0x38D01377, 0xBE5466CF, 0x34E90C6C,
+  0xC0AC29B7, 0xC97C50DD, 0x3F84D5B5, 0xB5470917
+};
+
+static const uint32_t iv[8] =
+{
+  0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+  0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+#define ADD(a,b)   _mm256_add_epi32( a, b )
+#define XOR(a,b)   _mm256_xor_si256( a, b )
+#define ROT(x,n)   _mm256_or_si256( _mm256_srli_epi32( x, n ), _mm256_slli_epi32( x, 32 - (n) ) )
+#define ROT16(x)   _mm256_shuffle_epi8( x, r16 )
+#define ROT8(x)    _mm256_shuffle_epi8( x, r8 )
+
+#define G(a,b,c,d,e) \
+  v[a] = ADD( ADD( v[a], XOR( m[sig[r][e]], _mm256_set1_epi32( z[sig[r][e+1]] ) ) ), v[b] ); \
+  v[d] = ROT16( XOR( v[d], v[a] ) ); \
+  v[c] = ADD( v[c], v[d] ); \
+  v[b] = ROT( XOR( v[b], v[c] ), 12 ); \
+  v[a] = ADD( ADD( v[a], XOR( m[sig[r][e+1]], _mm256_set1_epi32( z[sig[r][e]] ) ) ), v[b] ); \
+  v[d] = ROT8( XOR( v[d], v[a] ) ); \
+  v[c] = ADD( v[c], v[d] ); \
+  v[b] = ROT( XOR( v[b], v[c] ), 7 );
+
+
+// 8x8 transpose of 32-bit words, row j becomes lane j
+static inline void transpose8( __m256i r[8] )
+{
+  __m256i a0, a1, a2, a3, b[8];
+  int g, q;
+
+  for( g = 0; g < 2; ++g )
+  {
+    a0 = _mm256_unpacklo_epi32( r[4*g+0], r[4*g+1] );
+    a1 = _mm256_unpackhi_epi32( r[4*g+0], r[4*g+1] );
+    a2 = _mm256_unpacklo_epi32( r[4*g+2], r[4*g+3] );
+    a3 = _mm256_unpackhi_epi32( r[4*g+2], r[4*g+3] );
+    b[4*g+0] = _mm256_unpacklo_epi64( a0, a2 );
+    b[4*g+1] = _mm256_unpackhi_epi64( a0, a2 );
+    b[4*g+2] = _mm256_unpacklo_epi64( a1, a3 );
+    b[4*g+3] = _mm256_unpackhi_epi64( a1, a3 );
+  }
+
+  for( q = 0; q < 4; ++q )
+  {
+    r[q]   = _mm256_permute2x128_si256( b[q], b[4+q], 0x20 );
+    r[4+q] = _mm256_permute2x128_si256( b[q], b[4+q], 0x31 );
+  }
+}
+
+
+// load one 64-byte block of each lane, lanes are "stride" bytes apart
+static inline void load_block8( __m256i m[16], const uint8_t *in, uint64_t stride )
+{
+  const __m256i u8to32 = _mm256_set_epi8(
+    12,13,14,15, 8, 9,10,11, 4, 5, 6, 7, 0, 1, 2, 3,
+    12,13,14,15, 8, 9,10,11, 4, 5, 6, 7, 0, 1, 2, 3 );
+  int i;
+
+  for( i = 0; i < LANES; ++i )
+  {
+    m[i]     = _mm256_loadu_si256( (const __m256i *)(in + i * stride) );
+    m[8 + i] = _mm256_loadu_si256( (const __m256i *)(in + i * stride + 32) );
+  }
+
+  transpose8( m );
+  transpose8( m + 8 );
+
+  for( i = 0; i < 16; ++i )  m[i] = _mm256_shuffle_epi8( m[i], u8to32 );
+}
+
+
+static void compress8( __m256i h[8], const __m256i m[16], uint64_t t, int nullt )
+{
+  const __m256i r8  = _mm256_set_epi8(
+    12,15,14,13, 8,11,10, 9, 4, 7, 6, 5, 0, 3, 2, 1,
+    12,15,14,13, 8,11,10, 9, 4, 7, 6, 5, 0, 3, 2, 1 );
+  const __m256i r16 = _mm256_set_epi8(
+    13,12,15,14, 9, 8,11,10, 5, 4, 7, 6, 1, 0, 3, 2,
+    13,12,15,14, 9, 8,11,10, 5, 4, 7, 6, 1, 0, 3, 2 );
+  __m256i v[16];
+  int i, r;
+
+  for( i = 0; i < 8; ++i )  v[i] = h[i];
+
+  v[ 8] = _mm256_set1_epi32( z[0] );
+  v[ 9] = _mm256_set1_epi32( z[1] );
+  v[10] = _mm256_set1_epi32( z[2] );
+  v[11] = _mm256_set1_epi32( z[3] );
+
+  /* don't xor t when the block is only padding */
+  if ( nullt )
+  {
+    v[12] = _mm256_set1_epi32( z[4] );
+    v[13] = _mm256_set1_epi32( z[5] );
+    v[14] = _mm256_set1_epi32( z[6] );
+    v[15] = _mm256_set1_epi32( z[7] );
+  }
+  else
+  {
+    v[12] = _mm256_set1_epi32( z[4] ^ (uint32_t)t );
+    v[13] = _mm256_set1_epi32( z[5] ^ (uint32_t)t );
+    v[14] = _mm256_set1_epi32( z[6] ^ (uint32_t)(t >> 32) );
+    v[15] = _mm256_set1_epi32( z[7] ^ (uint32_t)(t >> 32) );
+  }
+
+  for( r = 0; r < 14; ++r )
+  {
+    /* column step */
+    G( 0,  4,  8, 12,  0 );
+    G( 1,  5,  9, 13,  2 );
+    G( 2,  6, 10, 14,  4 );
+    G( 3,  7, 11, 15,  6 );
+    /* diagonal step */
+    G( 0,  5, 10, 15,  8 );
+    G( 1,  6, 11, 12, 10 );
+    G( 2,  7,  8, 13, 12 );
+    G( 3,  4,  9, 14, 14 );
+  }
+
+  for( i = 0; i < 8; ++i )  h[i] = XOR( h[i], XOR( v[i], v[i + 8] ) );
+}
+
+
+// in:  8 consecutive messages of inlen bytes each
+// out: 8 consecutive 32-byte digests
+static inline __attribute__((always_inline))
+void hash8( uint8_t *out, const uint8_t *in, uint64_t inlen )
+{
+  const __m256i u8to32 = _mm256_set_epi8(
+    12,13,14,15, 8, 9,10,11, 4, 5, 6, 7, 0, 1, 2, 3,
+    12,13,14,15, 8, 9,10,11, 4, 5, 6, 7, 0, 1, 2, 3 );
+  __m256i h[8], m[16];
+  uint8_t tail[LANES][128];
+  uint64_t blocks = inlen / 64, rem = inlen % 64;
+  uint64_t bits = inlen << 3;
+  uint64_t b;
+  int i;
+
+  for( i = 0; i < 8; ++i )  h[i] = _mm256_set1_epi32( iv[i] );
+
+  /* compress the full blocks of all lanes */
+  for( b = 0; b < blocks; ++b )
+  {
+    load_block8( m, in + b * 64, inlen );
+    compress8( h, m, ( b + 1 ) << 9, 0 );
+  }
+
+  if ( rem == 0 )   /* whole blocks, the last one is only padding and the same in every lane */
+  {
+    for( i = 0; i < 16; ++i )  m[i] = _mm256_setzero_si256();
+    m[ 0] = _mm256_set1_epi32( 0x80000000 );
+    m[13] = _mm256_set1_epi32( 1 );
+    m[14] = _mm256_set1_epi32( ( uint32_t )( bits >> 32 ) );
+    m[15] = _mm256_set1_epi32( ( uint32_t ) bits );
+    compress8( h, m, bits, 1 );
+  }
+  else
+  {
+    /* the padding is the same for every lane, only the data differs */
+    for( i = 0; i < LANES; ++i )
+    {
+      memset( tail[i], 0, sizeof( tail[i] ) );
+      memcpy( tail[i], in + i * inlen + blocks * 64, ( size_t ) rem );
+      tail[i][rem] = 0x80;
+    }
+
+    if ( rem < 56 )   /* enough space to fill the block */
+    {
+      for( i = 0; i < LANES; ++i )
+      {
+        tail[i][55] |= 0x01;
+        U64TO8_BIG( tail[i] + 56, bits );
+      }
+      load_block8( m, tail[0], sizeof( tail[0] ) );
+      compress8( h, m, bits, 0 );
+    }
+    else   /* need 2 compressions */
+    {
+      for( i = 0; i < LANES; ++i )
+      {
+        tail[i][64 + 55] = 0x01;
+        U64TO8_BIG( tail[i] + 64 + 56, bits );
+      }
+      load_block8( m, tail[0], sizeof( tail[0] ) );
+      compress8( h, m, bits, 0 );
+      load_block8( m, tail[0] + 64, sizeof( tail[0] ) );
+      compress8( h, m, bits, 1 );
+    }
+  }
+
+  /* lane j holds the digest of message j */
+  transpose8( h );
+  for( i = 0; i < LANES; ++i )
+    _mm256_storeu_si256( (__m256i *)(out + i * 32), _mm256_shuffle_epi8( h[i], u8to32 ) );
+}
+
+
+// common leaf sizes get their own copy, with the block count and the
+// padding known at compile time
+void blake256_avx2_hash8( uint8_t *out, const uint8_t *in, uint64_t inlen )
+{
+  switch( inlen )
+  {
+    case 1024:  hash8( out, in, 1024 );  break;
+    case 2048:  hash8( out, in, 2048 );  break;
+    case 4096:  hash8( out, in, 4096 );  break;
+    case 8192:  hash8( out, in, 8192 );  break;
+    default:    hash8( out, in, inlen ); break;
+  }
+}
+
+
+#endif // __AVX2__
+
+// vim:set sw=2 ts=2 sts=2 expandtab:
@@ -0,0 +1,254 @@
+// Blake-256, AVX-512F multi-buffer
+//
+// Same scheme as blake256-avx2.c with 16 lanes. AVX-512F has native 32-bit
+// rotates (vprord), so G needs no shifts or byte shuffles at all.
+
+#include "blake.h"
+
+#ifdef __AVX512F__
+
+#include <immintrin.h>
+
+#define LANES 16
+
+static const uint8_t sig[14][16] =
+{
+  { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,15 },
+  {14,10, 4, 8, 9,15,13, 6, 1,12, 0, 2,11, 7, 5, 3 },
+  {11, 8,12, 0, 5, 2,15,13,10,14, 3, 6, 7, 1, 9, 4 },
+  { 7, 9, 3, 1,13,12,11,14, 2, 6, 5,10, 4, 0,15, 8 },
+  { 9, 0, 5, 7, 2, 4,10,15,14, 1,11,12, 6, 8, 3,13 },
+  { 2,12, 6,10, 0,11, 8, 3, 4,13, 7, 5,15,14, 1, 9 },
+  {12, 5, 1,15,14,13, 4,10, 0, 7, 6, 3, 9, 2, 8,11 },
+  {13,11, 7,14,12, 1, 3, 9, 5, 0,15, 4, 8, 6, 2,10 },
+  { 6,15,14, 9,11, 3, 0, 8,12, 2,13, 7, 1, 4,10, 5 },
+  {10, 2, 8, 4, 7, 6, 1, 5,15,11, 9,14, 3,12,13 ,0 },
+  { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,15 },
+  {14,10, 4, 8, 9,15,13, 6, 1,12, 0, 2,11, 7, 5, 3 },
+  {11, 8,12, 0, 5, 2,15,13,10,14, 3, 6, 7, 1, 9, 4 },
+  { 7, 9, 3, 1,13,12,11,14, 2, 6, 5,10, 4, 0,15, 8 }
+};
+
+static const uint32_t z[16] =
+{
+  0x243F6A88, 0x85A308D3, 0x13198A2E, 0x03707344,
+  0xA4093822, 0x299F31D0, 0x082EFA98, 0xEC4E6C89,
+  0x452821E6, 0x38D01377, 0xBE5466CF, 0x34E90C6C,
+  0xC0AC29B7, 0xC97C50DD, 0x3F84D5B5, 0xB5470917
+};
+
+static const uint32_t iv[8] =
+{
+  0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+  0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+#define ADD(a,b)   _mm512_add_epi32( a, b )
+#define XOR(a,b)   _mm512_xor_si512( a, b )
+#define ROT(x,n)   _mm512_ror_epi32( x, n )
+
+#define G(a,b,c,d,e) \
+  v[a] = ADD( ADD( v[a], XOR( m[sig[r][e]], _mm512_set1_epi32( z[sig[r][e+1]] ) ) ), v[b] ); \
+  v[d] = ROT( XOR( v[d], v[a] ), 16 ); \
+  v[c] = ADD( v[c], v[d] ); \
+  v[b] = ROT( XOR( v[b], v[c] ), 12 ); \
+  v[a] = ADD( ADD( v[a], XOR( m[sig[r][e+1]], _mm512_set1_epi32( z[sig[r][e]] ) ) ), v[b] ); \
+  v[d] = ROT( XOR( v[d], v[a] ),  8 ); \
+  v[c] = ADD( v[c], v[d] ); \
+  v[b] = ROT( XOR( v[b], v[c] ),  7 );
+
+
+// AVX-512F has no byte shuffle, swap with two rotates instead
+static inline __m512i bswap32( __m512i x )
+{
+  return _mm512_or_si512(
+    _mm512_and_si512( _mm512_ror_epi32( x, 8 ), _mm512_set1_epi32( 0xFF00FF00 ) ),
+    _mm512_and_si512( _mm512_rol_epi32( x, 8 ), _mm512_set1_epi32( 0x00FF00FF ) ) );
+}
+
+
+// 16x16 transpose of 32-bit words, row j becomes lane j
+// > 4x4 transposes inside the 128-bit lanes, then a 4x4 transpose of the
+//   128-bit lanes themselves
+static inline void transpose16( __m512i r[16] )
+{
+  __m512i a0, a1, a2, a3, b[16], x0, x1, x2, x3;
+  int g, q;
+
+  for( g = 0; g < 4; ++g )
+  {
+    a0 = _mm512_unpacklo_epi32( r[4*g+0], r[4*g+1] );
+    a1 = _mm512_unpackhi_epi32( r[4*g+0], r[4*g+1] );
+    a2 = _mm512_unpacklo_epi32( r[4*g+2], r[4*g+3] );
+    a3 = _mm512_unpackhi_epi32( r[4*g+2], r[4*g+3] );
+    b[4*g+0] = _mm512_unpacklo_epi64( a0, a2 );
+    b[4*g+1] = _mm512_unpackhi_epi64( a0, a2 );
+    b[4*g+2] = _mm512_unpacklo_epi64( a1, a3 );
+    b[4*g+3] = _mm512_unpackhi_epi64( a1, a3 );
+  }
+
+  for( q = 0; q < 4; ++q )
+  {
+    x0 = _mm512_shuffle_i32x4( b[q],     b[4+q],  0x44 );
+    x1 = _mm512_shuffle_i32x4( b[q],     b[4+q],  0xEE );
+    x2 = _mm512_shuffle_i32x4( b[8+q],   b[12+q], 0x44 );
+    x3 = _mm512_shuffle_i32x4( b[8+q],   b[12+q], 0xEE );
+    r[q]      = _mm512_shuffle_i32x4( x0, x2, 0x88 );
+    r[4+q]    = _mm512_shuffle_i32x4( x0, x2, 0xDD );
+    r[8+q]    = _mm512_shuffle_i32x4( x1, x3, 0x88 );
+    r[12+q]   = _mm512_shuffle_i32x4( x1, x3, 0xDD );
+  }
+}
+
+
+// load one 64-byte block of each lane, lanes are "stride" bytes apart
+static inline void load_block16( __m512i m[16], const uint8_t *in, uint64_t stride )
+{
+  int i;
+
+  for( i = 0; i < LANES; ++i )
+    m[i] = _mm512_loadu_si512( (const void *)(in + i * stride) );
+
+  transpose16( m );
+
+  for( i = 0; i < 16; ++i )  m[i] = bswap32( m[i] );
+}
+
+
+static void compress16( __m512i h[8], const __m512i m[16], uint64_t t, int nullt )
+{
+  __m512i v[16];
+  int i, r;
+
+  for( i = 0; i < 8; ++i )  v[i] = h[i];
+
+  v[ 8] = _mm512_set1_epi32( z[0] );
+  v[ 9] = _mm512_set1_epi32( z[1] );
+  v[10] = _mm512_set1_epi32( z[2] );
+  v[11] = _mm512_set1_epi32( z[3] );
+
+  /* don't xor t when the block is only padding */
+  if ( nullt )
+  {
+    v[12] = _mm512_set1_epi32( z[4] );
+    v[13] = _mm512_set1_epi32( z[5] );
+    v[14] = _mm512_set1_epi32( z[6] );
+    v[15] = _mm512_set1_epi32( z[7] );
+  }
+  else
+  {
+    v[12] = _mm512_set1_epi32( z[4] ^ (uint32_t)t );
+    v[13] = _mm512_set1_epi32( z[5] ^ (uint32_t)t );
+    v[14] = _mm512_set1_epi32( z[6] ^ (uint32_t)(t >> 32) );
+    v[15] = _mm512_set1_epi32( z[7] ^ (uint32_t)(t >> 32) );
+  }
+
+  for( r = 0; r < 14; ++r )
+  {
+    /* column step */
+    G( 0,  4,  8, 12,  0 );
+    G( 1,  5,  9, 13,  2 );
+    G( 2,  6, 10, 14,  4 );
+    G( 3,  7, 11, 15,  6 );
+    /* diagonal step */
+    G( 0,  5, 10, 15,  8 );
+    G( 1,  6, 11, 12, 10 );
+    G( 2,  7,  8, 13, 12 );
+    G( 3,  4,  9, 14, 14 );
+  }
+
+  for( i = 0; i < 8; ++i )  h[i] = XOR( h[i], XOR( v[i], v[i + 8] ) );
+}
+
+
+// in:  16 consecutive messages of inlen bytes each
+// out: 16 consecutive 32-byte digests
+static inline __attribute__((always_inline))
+void hash16( uint8_t *out, const uint8_t *in, uint64_t inlen )
+{
+  __m512i h[16], m[16];
+  uint8_t tail[LANES][128];
+  uint64_t blocks = inlen / 64, rem = inlen % 64;
+  uint64_t bits = inlen << 3;
+  uint64_t b;
+  int i;
+
+  for( i = 0; i < 8; ++i )  h[i] = _mm512_set1_epi32( iv[i] );
+
+  /* compress the full blocks of all lanes */
+  for( b = 0; b < blocks; ++b )
+  {
+    load_block16( m, in + b * 64, inlen );
+    compress16( h, m, ( b + 1 ) << 9, 0 );
+  }
+
+  if ( rem == 0 )   /* whole blocks, the last one is only padding and the same in every lane */
+  {
+    for( i = 0; i < 16; ++i )  m[i] = _mm512_setzero_si512();
+    m[ 0] = _mm512_set1_epi32( 0x80000000 );
+    m[13] = _mm512_set1_epi32( 1 );
+    m[14] = _mm512_set1_epi32( ( uint32_t )( bits >> 32 ) );
+    m[15] = _mm512_set1_epi32( ( uint32_t ) bits );
+    compress16( h, m, bits, 1 );
+  }
+  else
+  {
+    /* the padding is the same for every lane, only the data differs */
+    for( i = 0; i < LANES; ++i )
+    {
+      memset( tail[i], 0, sizeof( tail[i] ) );
+      memcpy( tail[i], in + i * inlen + blocks * 64, ( size_t ) rem );
+      tail[i][rem] = 0x80;
+    }
+
+    if ( rem < 56 )   /* enough space to fill the block */
+    {
+      for( i = 0; i < LANES; ++i )
+      {
+        tail[i][55] |= 0x01;
+        U64TO8_BIG( tail[i] + 56, bits );
+      }
+      load_block16( m, tail[0], sizeof( tail[0] ) );
+      compress16( h, m, bits, 0 );
+    }
+    else   /* need 2 compressions */
+    {
+      for( i = 0; i < LANES; ++i )
+      {
+        tail[i][64 + 55] = 0x01;
+        U64TO8_BIG( tail[i] + 64 + 56, bits );
+      }
+      load_block16( m, tail[0], sizeof( tail[0] ) );
+      compress16( h, m, bits, 0 );
+      load_block16( m, tail[0] + 64, sizeof( tail[0] ) );
+      compress16( h, m, bits, 1 );
+    }
+  }
+
+  /* lane j holds the digest of message j, the upper 8 rows are don't care */
+  for( i = 8; i < 16; ++i )  h[i] = _mm512_setzero_si512();
+  transpose16( h );
+  for( i = 0; i < LANES; ++i )
+    _mm256_storeu_si256( (__m256i *)(out + i * 32),
+      _mm512_castsi512_si256( bswap32( h[i] ) ) );
+}
+
+
+// common leaf sizes get their own copy, with the block count and the
+// padding known at compile time
+void blake256_avx512_hash16( uint8_t *out, const uint8_t *in, uint64_t inlen )
+{
+  switch( inlen )
+  {
+    case 1024:  hash16( out, in, 1024 );  break;
+    case 2048:  hash16( out, in, 2048 );  break;
+    case 4096:  hash16( out, in, 4096 );  break;
+    case 8192:  hash16( out, in, 8192 );  break;
+    default:    hash16( out, in, inlen ); break;
+  }
+}
+
+
+#endif // __AVX512F__
+
+// vim:set sw=2 ts=2 sts=2 expandtab:
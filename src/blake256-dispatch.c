@@ -0,0 +1,106 @@
+// Blake-256, runtime selection of the CPU implementation
+//
+// The backends are compiled with their own instruction set flags (see the
+// Makefile), this file only uses baseline instructions. The selection
+// happens before main() and can be overridden by the BLAKETREE_IMPL
+// environment variable or blake256_select_impl().
+
+#include "blake.h"
+#include "log.h"
+
+#include <stdlib.h>
+
+
+static int supports_ref( void )    { return 1; }
+static int supports_sse2( void )   { return __builtin_cpu_supports( "sse2" ); }
+static int supports_ssse3( void )  { return __builtin_cpu_supports( "ssse3" ); }
+static int supports_avx2( void )   { return __builtin_cpu_supports( "avx2" ) && supports_ssse3(); }
+static int supports_avx512( void ) { return __builtin_cpu_supports( "avx512f" ) && supports_ssse3(); }
+
+
+// table positions, fastest first
+enum { IMPL_AVX512, IMPL_AVX2, IMPL_SSSE3, IMPL_SSE2, IMPL_REF };
+
+const blake256_impl_t blake256_impls[] =
+{
+  [IMPL_AVX512] = { "avx512", supports_avx512,
+    blake256_ssse3_init, blake256_ssse3_compress, blake256_ssse3_update,
+    blake256_ssse3_final, blake256_ssse3_hash, blake256_ssse3_hash_leaf,
+    blake256_avx512_hash16, 16 },
+  [IMPL_AVX2] = { "avx2", supports_avx2,
+    blake256_ssse3_init, blake256_ssse3_compress, blake256_ssse3_update,
+    blake256_ssse3_final, blake256_ssse3_hash, blake256_ssse3_hash_leaf,
+    blake256_avx2_hash8, 8 },
+  [IMPL_SSSE3] = { "ssse3", supports_ssse3,
+    blake256_ssse3_init, blake256_ssse3_compress, blake256_ssse3_update,
+    blake256_ssse3_final, blake256_ssse3_hash, blake256_ssse3_hash_leaf,
+    blake256_ssse3_hash_leaf, 1 },
+  [IMPL_SSE2] = { "sse2", supports_sse2,
+    blake256_sse2_init, blake256_sse2_compress, blake256_sse2_update,
+    blake256_sse2_final, blake256_sse2_hash, blake256_sse2_hash_leaf,
+    blake256_sse2_hash_leaf, 1 },
+  [IMPL_REF] = { "ref", supports_ref,
+    blake256_ref_init, blake256_ref_compress, blake256_ref_update,
+    blake256_ref_final, blake256_ref_hash, blake256_ref_hash_leaf,
+    blake256_ref_hash_leaf, 1 },
+  [IMPL_REF + 1] = { NULL }
+};
+
+// "ref" until blake256_dispatch_init() has run
+const blake256_impl_t *blake256_impl = &blake256_impls[IMPL_REF];
+
+
+const blake256_impl_t *blake256_find_impl( const blake256_impl_t *impls, const char *name )
+{
+  const blake256_impl_t *impl;
+  int autoselect = ( name == NULL || strcmp( name, "auto" ) == 0 );
+
+  for( impl = impls; impl->name; ++impl )
+  {
+    if ( !autoselect && strcmp( impl->name, name ) != 0 )
+      continue;
+
+    // auto skips what the CPU lacks, a named one has to be supported
+    if ( !impl->supported() )
+    {
+      if ( autoselect )
+        continue;
+      return NULL;
+    }
+
+    return impl;
+  }
+
+  return NULL;
+}
+
+
+int blake256_select_impl( const char *name )
+{
+  const blake256_impl_t *impl = blake256_find_impl( blake256_impls, name );
+
+  if ( !impl )
+    return 0;
+
+  blake256_impl = impl;
+  return 1;
+}
+
+
+__attribute__((constructor))
+static void blake256_dispatch_init( void )
+{
+  const char *name = getenv( BLAKE256_IMPL_ENV );
+
+  __builtin_cpu_init();
+
+  if ( !blake256_select_impl( name ) )
+  {
+    // only a named implementation can fail, ref is always supported
+    loggerf( ERROR, "%s: implementation \"%s\" is unknown or not supported, using auto",
+      BLAKE256_IMPL_ENV, name ? name : "auto" );
+    blake256_select_impl( NULL );
+  }
+}
+
+// vim:set sw=2 ts=2 sts=2 expandtab:
@@ -0,0 +1,61 @@
+// Blake-256 of whole blocks, for the tree leaves
+//
+// Leaves are a multiple of 64 bytes long (see blakeTree_set_geometry()), so
+// the buffering and padding logic of update() and final() isn't needed:
+// every block is compressed in place, the counter of each block is known
+// and the last block is only padding, the same for every leaf of a size.
+// Included by the scalar backends, which define LEAF_INIT and
+// LEAF_COMPRESS first.
+
+static inline __attribute__((always_inline))
+void leaf_blocks( uint8_t *out, const uint8_t *in, uint64_t inlen )
+{
+  uint8_t pad[64] = { 0x80 };
+  state256 S;
+  uint64_t b, t;
+  int i;
+
+  LEAF_INIT( &S );
+
+  for( b = 0; b < inlen / 64; ++b )
+  {
+    t = ( b + 1 ) << 9;
+    S.t[0] = ( uint32_t ) t;
+    S.t[1] = ( uint32_t )( t >> 32 );
+    LEAF_COMPRESS( &S, in + b * 64 );
+  }
+
+  /* padding only, don't xor t */
+  pad[55] = 0x01;
+  U64TO8_BIG( pad + 56, inlen << 3 );
+  S.nullt = 1;
+  LEAF_COMPRESS( &S, pad );
+
+  for( i = 0; i < 8; ++i )
+  {
+    U32TO8_BIG( out + 4 * i, S.h[i] );
+  }
+}
+
+
+// common leaf sizes get their own copy, with all counters constant
+// > other lengths go through the generic hash
+#define LEAF_HASH_DEFINE( name, generic_hash ) \
+void name( uint8_t *out, const uint8_t *in, uint64_t inlen ) \
+{ \
+  if ( inlen % 64 ) \
+  { \
+    generic_hash( out, in, inlen ); \
+    return; \
+  } \
+  switch( inlen ) \
+  { \
+    case 1024:  leaf_blocks( out, in, 1024 );  break; \
+    case 2048:  leaf_blocks( out, in, 2048 );  break; \
+    case 4096:  leaf_blocks( out, in, 4096 );  break; \
+    case 8192:  leaf_blocks( out, in, 8192 );  break; \
+    default:    leaf_blocks( out, in, inlen ); break; \
+  } \
+}
+
+// vim:set sw=2 ts=2 sts=2 expandtab:
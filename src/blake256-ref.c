@@ -215,3 +215,10 @@ void blake256_ref_hash( uint8_t *out, const uint8_t *in, uint64_t inlen )
 }
 
 
+#define LEAF_INIT      blake256_ref_init
+#define LEAF_COMPRESS  blake256_ref_compress
+#include "blake256-leaf.h"
+
+LEAF_HASH_DEFINE( blake256_ref_hash_leaf, blake256_ref_hash )
+
+
@@ -387,6 +387,13 @@ void blake256_sse2_hash( uint8_t *out, const uint8_t *in, uint64_t inlen )
 }
 
 
+#define LEAF_INIT      blake256_sse2_init
+#define LEAF_COMPRESS  blake256_sse2_compress
+#include "blake256-leaf.h"
+
+LEAF_HASH_DEFINE( blake256_sse2_hash_leaf, blake256_sse2_hash )
+
+
 #endif // __SSE2__
 
 // vim:set sw=2 ts=2 sts=2 expandtab:
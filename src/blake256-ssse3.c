@@ -312,6 +312,13 @@ void blake256_ssse3_hash( unsigned char *out, const unsigned char *in, uint64_t
 }
 
 
+#define LEAF_INIT      blake256_ssse3_init
+#define LEAF_COMPRESS  blake256_ssse3_compress
+#include "blake256-leaf.h"
+
+LEAF_HASH_DEFINE( blake256_ssse3_hash_leaf, blake256_ssse3_hash )
+
+
 
 #endif // __SSSE3__
 
@@ -1,8 +1,25 @@
 /* BLAKE-256 hash algorithm in OpenCL
  *
  * Restrictions:
- * - block size must be a multiple of 64 bytes
- * - block size must be < 2^32 bytes
+ * - leaf size must be a multiple of 64 bytes, a partial last leaf is hashed
+ *   by blake256_hash_tail
+ * - leaf size must be < 2^29 bytes (the counter is 32 bits)
+ * - -D LEAF_SIZE=n builds a kernel for leaves of exactly n bytes, with the
+ *   block loop unrolled. chunk_size is ignored then.
+ * - the leaf kernels hash the first "leaves" leaves, the NDRange may be
+ *   larger
+ *
+ * Kernels:
+ * - blake256_hash_block: one work-item per leaf, reading its own leaf.
+ *   Neighbouring work-items read addresses a leaf apart, which never coalesces.
+ * - blake256_hash_block_staged: a work-group of STAGE_WG work-items loads
+ *   block b of all its leaves together into local memory, 16 neighbouring
+ *   work-items read the 16 words of one block. The local size must be
+ *   STAGE_WG.
+ * - blake256_hash_tail: a single work-item hashes the partial last leaf,
+ *   with the full BLAKE padding.
+ * - blake256_hash_nodes: one work-item per tree node, hashes node_len bytes
+ *   of leaf hashes (fanout * 32, a multiple of 64) into the next level.
  *
  * Lessons learned:
  * - byte-wise read access to global can be much slower than word-wise. 
@@ -98,11 +115,56 @@ constant uint32_t u256[16] =
   } while (0)
 
 
+// compress the message words m
+// > padding_only: don't xor the counter, for the final block
+void blake256_compress_m( private state256 *S, private const uint32_t *m, int padding_only )
+{
+  private uint32_t v[16], i;
+
+  //#pragma unroll 8
+  for( i = 0; i < 8; ++i )  v[i] = S->h[i];
+
+  v[ 8] = u256[0];
+  v[ 9] = u256[1];
+  v[10] = u256[2];
+  v[11] = u256[3];
+  v[12] = u256[4];
+  v[13] = u256[5];
+  v[14] = u256[6];
+  v[15] = u256[7];
+ 
+  if(!padding_only)
+  {
+    /* don't xor t when the block is only padding */
+    v[12] ^= S->t;
+    v[13] ^= S->t;
+  }
+
+  // #pragma unroll 2
+  for(int r = 0; r < NB_ROUNDS32; ++r )
+  {
+    /* column step */
+    G( 0,  4,  8, 12,  0 );
+    G( 1,  5,  9, 13,  2 );
+    G( 2,  6, 10, 14,  4 );
+    G( 3,  7, 11, 15,  6 );
+    /* diagonal step */
+    G( 0,  5, 10, 15,  8 );
+    G( 1,  6, 11, 12, 10 );
+    G( 2,  7,  8, 13, 12 );
+    G( 3,  4,  9, 14, 14 );
+  }
+
+  //#pragma unroll
+  for( i = 0; i < 16; ++i )  S->h[i % 8] ^= v[i];
+}
+
+
 // compress a block
 // if block == 0, finalize
 void blake256_compress_block( private state256 *S, global const uint32_t *block )
 {
-  private uint32_t v[16], m[16], i;
+  private uint32_t m[16], i;
   private uint32_t m_temp[16];
 
   // This conditional doesn't have a signifant performance impact
@@ -136,45 +198,14 @@ void blake256_compress_block( private state256 *S, global const uint32_t *block
     m[0] = 0x80000000;
     m[1] = m[2] = m[3] = m[4] = m[5] = m[6] = m[7] = 0;
     m[8] = m[9] = m[10] = m[11] = m[12] = 0; m[13] = 1; m[14] = 0; 
+#ifdef LEAF_SIZE
+    m[15] = LEAF_SIZE * 8;
+#else
     m[15] = S->t;
+#endif
   }
 
-  //#pragma unroll 8
-  for( i = 0; i < 8; ++i )  v[i] = S->h[i];
-
-  v[ 8] = u256[0];
-  v[ 9] = u256[1];
-  v[10] = u256[2];
-  v[11] = u256[3];
-  v[12] = u256[4];
-  v[13] = u256[5];
-  v[14] = u256[6];
-  v[15] = u256[7];
- 
-  if(block != 0)
-  {
-    /* don't xor t when the block is only padding */
-    v[12] ^= S->t;
-    v[13] ^= S->t;
-  }
-
-  // #pragma unroll 2
-  for(int r = 0; r < NB_ROUNDS32; ++r )
-  {
-    /* column step */
-    G( 0,  4,  8, 12,  0 );
-    G( 1,  5,  9, 13,  2 );
-    G( 2,  6, 10, 14,  4 );
-    G( 3,  7, 11, 15,  6 );
-    /* diagonal step */
-    G( 0,  5, 10, 15,  8 );
-    G( 1,  6, 11, 12, 10 );
-    G( 2,  7,  8, 13, 12 );
-    G( 3,  4,  9, 14, 14 );
-  }
-
-  //#pragma unroll
-  for( i = 0; i < 16; ++i )  S->h[i % 8] ^= v[i];
+  blake256_compress_m( S, m, block == 0 );
 }
 
 
@@ -205,10 +236,23 @@ void blake256_update( private state256 *S, global const uint32_t *in, uint32_t i
 }
 
 
-void blake256_final( private state256 *S, global uint32_t *out)
+#ifdef LEAF_SIZE
+// the trip count is known, so the loop can be unrolled and every counter
+// is a constant, as is the final padding block (see blake256_compress_block)
+void blake256_update_leaf( private state256 *S, global const uint32_t *in )
 {
-  blake256_compress_block( S, 0 );
+  #pragma unroll
+  for( int b = 0; b < LEAF_SIZE / 64; ++b )
+  {
+    S->t = ( b + 1 ) * 512;
+    blake256_compress_block( S, in + b * 16 );
+  }
+}
+#endif
+
 
+void blake256_store( private state256 *S, global uint32_t *out )
+{
   private uint8_t tmp[32];
   U32TO8_BIG( tmp + 0, S->h[0] );
   U32TO8_BIG( tmp + 4, S->h[1] );
@@ -226,18 +270,144 @@ void blake256_final( private state256 *S, global uint32_t *out)
 }
 
 
-kernel void blake256_hash_block( global uint8_t *out, global const uint8_t *in, const uint32_t chunk_size)
+void blake256_final( private state256 *S, global uint32_t *out)
+{
+  blake256_compress_block( S, 0 );
+  blake256_store( S, out );
+}
+
+
+kernel void blake256_hash_block( global uint8_t *out, global const uint8_t *in, const uint32_t chunk_size, 
+  const uint32_t leaves )
 {
   const int gx = get_global_id(0);
   const int lx = get_local_id(0);
 
+  private state256 S;
+
+  if( gx >= leaves )  return;
+
+#ifdef LEAF_SIZE
+  global uint8_t* item_in  = &( in[gx * LEAF_SIZE] );
+  global uint8_t* item_out = &(out[gx * 32]);
+
+  blake256_init( &S );
+  blake256_update_leaf( &S, item_in );
+#else
   global uint8_t* item_in  = &( in[gx * chunk_size] );
   global uint8_t* item_out = &(out[gx * 32]);
-  private state256 S;
-  
+
   blake256_init( &S );
   blake256_update( &S, item_in, chunk_size );
+#endif
   blake256_final( &S, item_out );
 }
 
+
+#ifndef STAGE_WG
+#define STAGE_WG 64
+#endif
+
+kernel __attribute__((reqd_work_group_size(STAGE_WG, 1, 1)))
+void blake256_hash_block_staged( global uint8_t *out, global const uint8_t *in, const uint32_t chunk_size, 
+  const uint32_t leaves )
+{
+#ifdef LEAF_SIZE
+  const uint32_t leaf_words = LEAF_SIZE / 4;
+#else
+  const uint32_t leaf_words = chunk_size / 4;
+#endif
+  const int lx = get_local_id(0);
+  const int first = get_group_id(0) * STAGE_WG;
+
+  // one block per leaf of the group, padded against bank conflicts
+  local uint32_t blocks[STAGE_WG * 17];
+
+  global const uint32_t *group_in = (global const uint32_t *) in + first * leaf_words;
+  private uint32_t m[16], m_temp[16];
+  private state256 S;
+
+  blake256_init( &S );
+
+  for( uint32_t b = 0; b < leaf_words / 16; ++b )
+  {
+    // word w of the group's blocks: word w % 16 of the leaf w / 16
+    // > the work-items past the last leaf take part in the barriers only
+    for( int w = lx; w < STAGE_WG * 16; w += STAGE_WG )
+    {
+      if( first + w / 16 < leaves )
+        blocks[(w / 16) * 17 + w % 16] = group_in[(w / 16) * leaf_words + b * 16 + w % 16];
+    }
+    barrier( CLK_LOCAL_MEM_FENCE );
+
+    for( int i = 0; i < 16; ++i )  m_temp[i] = blocks[lx * 17 + i];
+    for( int i = 0; i < 16; ++i )  m[i] = U8TO32_BIG( (uint8_t*) &m_temp[i] );
+    barrier( CLK_LOCAL_MEM_FENCE );
+
+    S.t = ( b + 1 ) * 512;
+    blake256_compress_m( &S, m, 0 );
+  }
+
+  if( first + lx < leaves )
+    blake256_final( &S, (global uint32_t *) &out[(first + lx) * 32] );
+}
+
+
+// hash inlen bytes of leaf "index", 0 < inlen < leaf_size
+// > the full blocks go through blake256_update, the rest is padded in
+//   private memory like blake256_final() of the CPU implementations does
+kernel void blake256_hash_tail( global uint8_t *out, global const uint8_t *in, const uint32_t leaf_size, 
+  const uint32_t index, const uint32_t inlen )
+{
+  const uint32_t full = inlen & ~63u;
+  const uint32_t rem  = inlen - full;
+  const uint32_t bits = inlen * 8;
+  const int blocks = ( rem < 56 ) ? 1 : 2;
+
+  global const uint8_t *leaf = &in[index * leaf_size];
+  private uint8_t block[128];
+  private uint32_t m[16];
+  private state256 S;
+
+  blake256_init( &S );
+  blake256_update( &S, (global const uint32_t *) leaf, full );
+
+  for( int i = 0; i < 128; ++i )  block[i] = 0;
+  for( uint32_t i = 0; i < rem; ++i )  block[i] = leaf[full + i];
+  block[rem] = 0x80;
+  block[blocks * 64 - 9] |= 0x01;
+  U32TO8_BIG( block + blocks * 64 - 4, bits );
+
+  S.t = bits;
+  for( int b = 0; b < blocks; ++b )
+  {
+    for( int i = 0; i < 16; ++i )  m[i] = U8TO32_BIG( block + b * 64 + i * 4 );
+    // the counter is skipped for a block without message bits
+    blake256_compress_m( &S, m, rem == 0 || b == 1 );
+  }
+
+  blake256_store( &S, (global uint32_t *) &out[index * 32] );
+}
+
+
+// nodes don't have the leaf size, so the padding block is built here
+kernel void blake256_hash_nodes( global uint8_t *out, global const uint8_t *in, const uint32_t node_len )
+{
+  const int gx = get_global_id(0);
+
+  private uint32_t m[16];
+  private state256 S;
+
+  blake256_init( &S );
+  blake256_update( &S, (global const uint32_t *) &in[gx * node_len], node_len );
+
+  for( int i = 0; i < 16; ++i )  m[i] = 0;
+  m[ 0] = 0x80000000;
+  m[13] = 1;
+  m[15] = node_len * 8;
+  blake256_compress_m( &S, m, 1 );
+
+  blake256_store( &S, (global uint32_t *) &out[gx * 32] );
+}
+
 // vim:set ft=c ts=2 sw=2 expandtab:
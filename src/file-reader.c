@@ -0,0 +1,439 @@
+#define _GNU_SOURCE
+
+#include "file-reader.h"
+#include "uring.h"
+#include "log.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+
+static const char* mode_names[] = {
+	"auto", "read", "mmap", "uring", "direct",
+};
+
+
+int freader_parse_mode(const char* name)
+{
+	for(int i=0; i < sizeof(mode_names)/sizeof(char*); i++) {
+		if(strcmp(name, mode_names[i]) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+static int freader_map(freader_t* r)
+{
+	void *map;
+
+	map = mmap(NULL, r->size, PROT_READ, MAP_SHARED, r->fd, 0);
+	if(map == MAP_FAILED) {
+		return 0;
+	}
+	madvise(map, r->size, MADV_SEQUENTIAL);
+	r->map = map;
+	return 1;
+}
+
+
+freader_t* freader_open(const char* filename, freader_mode_t mode)
+{
+	freader_t* r;
+	struct stat st;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if(fd < 0) {
+		return NULL;
+	}
+
+	r = calloc(1, sizeof(freader_t));
+	r->fd = fd;
+	r->fd_direct = -1;
+	r->mode = FREADER_READ;
+	r->handed_out = -1;
+
+	// only regular files and block devices have a size and can be mapped
+	if(fstat(fd, &st) == 0) {
+		if(S_ISREG(st.st_mode)) {
+			r->size = st.st_size;
+		}
+		else if(S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &r->size) != 0) {
+			r->size = 0;
+		}
+	}
+
+	if(mode == FREADER_DIRECT) {
+		// some filesystems (tmpfs, ...) refuse O_DIRECT
+		r->fd_direct = open(filename, O_RDONLY | O_DIRECT);
+		if(r->fd_direct >= 0) {
+			r->mode = FREADER_DIRECT;
+		} else {
+			loggerf(DEBUG, "O_DIRECT failed, falling back to read(): %s", strerror(errno));
+		}
+	}
+	else if(mode == FREADER_URING && r->size > 0) {
+		r->ring = uring_init(FREADER_MAX_PENDING);
+		if(r->ring) {
+			r->mode = FREADER_URING;
+		} else {
+			loggerf(DEBUG, "io_uring not available, falling back to read()");
+		}
+	}
+	else if((mode == FREADER_AUTO || mode == FREADER_MMAP) && r->size > 0) {
+		if(freader_map(r)) {
+			r->mode = FREADER_MMAP;
+		} else {
+			loggerf(DEBUG, "mmap() failed, falling back to read(): %s", strerror(errno));
+		}
+	}
+
+	loggerf(DEBUG, "Input engine: %s", mode_names[r->mode]);
+	return r;
+}
+
+
+static bool is_aligned(uint64_t x)
+{
+	return (x & (FREADER_ALIGN - 1)) == 0;
+}
+
+
+// like pread(), only returns less than len at EOF
+// > direct mode reads the aligned part with O_DIRECT and only the unaligned
+//   tail of the file through the page cache, which is dropped afterwards
+static size_t pread_full(freader_t* r, uint8_t* buf, size_t len, uint64_t offset)
+{
+	size_t total = 0;
+	bool refused = false;
+	ssize_t n;
+	int fd;
+
+	while(total < len) {
+		fd = r->fd;
+		if(r->fd_direct >= 0 && !refused && is_aligned(offset + total) && 
+			is_aligned((uintptr_t) (buf + total)) && is_aligned(len - total)) 
+		{
+			fd = r->fd_direct;
+		}
+
+		n = pread(fd, buf + total, len - total, offset + total);
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+		if(n < 0 && errno == EINVAL && fd == r->fd_direct) {
+			// the tail of a file is refused by some filesystems
+			loggerf(DEBUG, "O_DIRECT read at %llu refused, using the page cache",
+				(unsigned long long) (offset + total));
+			refused = true;
+			continue;
+		}
+		if(n < 0) {
+			loggerf(ERROR, "pread() failed: %s", strerror(errno));
+			exit(1);
+		}
+		if(n == 0) {
+			break;
+		}
+		if(fd == r->fd && r->mode == FREADER_DIRECT) {
+			posix_fadvise(fd, offset + total, n, POSIX_FADV_DONTNEED);
+		}
+		total += n;
+	}
+	return total;
+}
+
+
+// like fread(), only returns less than len at EOF
+static size_t read_full(int fd, uint8_t* buf, size_t len)
+{
+	size_t total = 0;
+	ssize_t n;
+
+	while(total < len) {
+		n = read(fd, buf + total, len - total);
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+		if(n < 0) {
+			loggerf(ERROR, "read() failed: %s", strerror(errno));
+			exit(1);
+		}
+		if(n == 0) {
+			break;
+		}
+		total += n;
+	}
+	return total;
+}
+
+
+// request handling, see freader_submit()
+
+static void uring_submit_req(freader_t* r, freader_req_t* req)
+{
+	uring_read(r->ring, r->fd, req->buf + req->got, req->len - req->got, 
+		req->offset + req->got, req->buf_index, req - r->reqs);
+}
+
+
+static void uring_handle_completion(freader_t* r, uint64_t tag, int res)
+{
+	freader_req_t* req = &r->reqs[tag];
+
+	if(res == -EINTR || res == -EAGAIN) {
+		uring_submit_req(r, req);
+		return;
+	}
+	if(res < 0) {
+		loggerf(ERROR, "io_uring read failed: %s", strerror(-res));
+		exit(1);
+	}
+
+	// short reads are continued, like read_full() does
+	req->got += res;
+	if(res == 0 || req->got == req->len) {
+		req->done = true;
+	} else {
+		uring_submit_req(r, req);
+	}
+}
+
+
+static void submit_req(freader_t* r, uint8_t* buf, size_t len, int buf_index)
+{
+	freader_req_t* req;
+	const uint8_t* window;
+
+	if(r->pending == FREADER_MAX_PENDING) {
+		loggerf(ERROR, "Logic error. Too many pending reads.");
+		exit(1);
+	}
+
+	req = &r->reqs[(r->head + r->pending) % FREADER_MAX_PENDING];
+	req->buf = buf;
+	req->len = len;
+	req->offset = r->submit_offset;
+	req->got = 0;
+	req->buf_index = buf_index;
+	req->done = false;
+	req->sec = 0;
+	r->pending++;
+
+	if(r->mode == FREADER_URING) {
+		if(req->offset >= r->size) {
+			req->done = true;
+		} else {
+			uring_submit_req(r, req);
+		}
+		r->submit_offset += len;
+		r->eof = (r->submit_offset >= r->size);
+		return;
+	}
+
+	// synchronous modes
+	double start = stats_now();
+	uint64_t trace = trace_begin();
+	req->got = freader_next(r, buf, len, &window);
+	if(window != buf) {
+		memcpy(buf, window, req->got);
+	}
+	req->done = true;
+	req->sec = stats_now() - start;
+	trace_end("read", trace, req->got);
+	r->submit_offset += req->got;
+	r->eof = (req->got < len);
+}
+
+
+static size_t complete_req(freader_t* r, uint8_t** buf, int* buf_index)
+{
+	freader_req_t* req = &r->reqs[r->head];
+	uint64_t tag;
+	int res;
+
+	double start = stats_now();
+	uint64_t trace = trace_begin();
+	while(!req->done) {
+		res = uring_wait(r->ring, &tag);
+		uring_handle_completion(r, tag, res);
+	}
+	req->sec += stats_now() - start;
+	trace_end("read wait", trace, 0);
+
+	r->head = (r->head + 1) % FREADER_MAX_PENDING;
+	r->pending--;
+
+	if(buf) *buf = req->buf;
+	if(buf_index) *buf_index = req->buf_index;
+	return req->got;
+}
+
+
+void freader_submit(freader_t* r, uint8_t* buf, size_t len)
+{
+	submit_req(r, buf, len, -1);
+}
+
+
+size_t freader_complete(freader_t* r, uint8_t** buf)
+{
+	freader_req_t* req = &r->reqs[r->head];
+	size_t n = complete_req(r, buf, NULL);
+	if(n) {
+		stats_add(STATS_READ, req->sec, n);
+	}
+	return n;
+}
+
+
+bool freader_ready(freader_t* r)
+{
+	uint64_t tag;
+	int res;
+
+	if(r->pending == 0) {
+		return false;
+	}
+	if(r->mode == FREADER_URING) {
+		while(uring_poll(r->ring, &tag, &res)) {
+			uring_handle_completion(r, tag, res);
+		}
+	}
+	return r->reqs[r->head].done;
+}
+
+
+// uring mode: FREADER_URING_BUFFERS chunks are read ahead into page aligned
+// buffers, registered with the kernel if the memlock limit allows it
+static size_t uring_next(freader_t* r, size_t len, const uint8_t** window)
+{
+	uint8_t* buf;
+	int idx;
+	size_t n;
+
+	if(!r->bufs[0]) {
+		for(int i=0; i < FREADER_URING_BUFFERS; i++) {
+			r->bufs[i] = freader_alloc(len);
+		}
+		r->registered = uring_register_buffers(r->ring, r->bufs, FREADER_URING_BUFFERS, len);
+		for(int i=0; i < FREADER_URING_BUFFERS && !r->eof; i++) {
+			submit_req(r, r->bufs[i], len, r->registered ? i : -1);
+		}
+	}
+	else if(r->handed_out >= 0 && !r->eof) {
+		idx = r->handed_out;
+		submit_req(r, r->bufs[idx], len, r->registered ? idx : -1);
+	}
+
+	if(r->pending == 0) {
+		return 0;
+	}
+
+	n = complete_req(r, &buf, NULL);
+	for(idx = 0; r->bufs[idx] != buf; idx++);
+	r->handed_out = idx;
+	r->offset += n;
+	*window = buf;
+	return n;
+}
+
+
+size_t freader_next(freader_t* r, uint8_t* buf, size_t len, const uint8_t** window)
+{
+	size_t n;
+
+	if(r->mode == FREADER_URING) {
+		return uring_next(r, len, window);
+	}
+
+	if(r->mode == FREADER_MMAP) {
+		if(r->offset >= r->size) {
+			return 0;
+		}
+		n = (r->size - r->offset < len) ? r->size - r->offset : len;
+		*window = r->map + r->offset;
+		r->offset += n;
+
+		// start reading ahead the window after this one
+		// > madvise() wants a page aligned address
+		if(r->offset < r->size) {
+			uint64_t page  = sysconf(_SC_PAGESIZE);
+			uint64_t start = r->offset & ~(page - 1);
+			uint64_t end   = (r->size - r->offset < len) ? r->size : r->offset + len;
+			madvise(r->map + start, end - start, MADV_WILLNEED);
+		}
+		return n;
+	}
+
+	if(r->mode == FREADER_DIRECT) {
+		n = pread_full(r, buf, len, r->offset);
+	} else {
+		n = read_full(r->fd, buf, len);
+	}
+	*window = buf;
+	r->offset += n;
+	return n;
+}
+
+
+size_t freader_pread(freader_t* r, uint8_t* buf, size_t len, uint64_t offset,
+	const uint8_t** window)
+{
+	if(r->mode == FREADER_MMAP) {
+		if(offset >= r->size) {
+			return 0;
+		}
+		*window = r->map + offset;
+		return (r->size - offset < len) ? r->size - offset : len;
+	}
+
+	*window = buf;
+	return pread_full(r, buf, len, offset);
+}
+
+
+void freader_close(freader_t* r)
+{
+	// the kernel may still write into the buffers
+	while(r->pending) {
+		complete_req(r, NULL, NULL);
+	}
+	if(r->ring) {
+		uring_exit(r->ring);
+	}
+	for(int i=0; i < FREADER_URING_BUFFERS; i++) {
+		free(r->bufs[i]);
+	}
+	if(r->map) {
+		munmap(r->map, r->size);
+	}
+	if(r->fd_direct >= 0) {
+		close(r->fd_direct);
+	}
+	close(r->fd);
+	free(r);
+}
+
+
+uint8_t* freader_alloc(size_t len)
+{
+	void* p;
+
+	if(posix_memalign(&p, FREADER_ALIGN, len) != 0) {
+		loggerf(ERROR, "Out of memory");
+		exit(1);
+	}
+	return p;
+}
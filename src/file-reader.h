@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Input engines for the file hashing loops
+// > mmap:  zero-copy windows into a mapping of the whole file
+// > uring: io_uring reads with several requests in flight, regular files only
+// > direct: O_DIRECT reads that bypass the page cache, for scrubbing cold
+//   images and block devices
+// > read:  plain read() into the caller's buffer, used for pipes, special
+//   files and as the fallback for everything else
+typedef enum {
+	FREADER_AUTO,
+	FREADER_READ,
+	FREADER_MMAP,
+	FREADER_URING,
+	FREADER_DIRECT,
+} freader_mode_t;
+
+// O_DIRECT wants buffers, offsets and lengths aligned to the logical block
+// size, a page covers all common devices
+#define FREADER_ALIGN 4096
+
+// maximum number of reads in flight
+#define FREADER_MAX_PENDING 32
+
+// read-ahead buffers of freader_next() in uring mode
+#define FREADER_URING_BUFFERS 4
+
+typedef struct {
+	uint8_t* buf;
+	size_t len;
+	uint64_t offset;
+	size_t got;
+	int buf_index;        // registered buffer, -1 if none
+	bool done;
+	double sec;           // time spent reading, see stats.h
+} freader_req_t;
+
+typedef struct {
+	int fd;
+	int fd_direct;        // direct mode, fd is used for the unaligned tail
+	freader_mode_t mode;  // never FREADER_AUTO after freader_open()
+	uint64_t size;        // 0 if unknown, block devices are sized by ioctl()
+	uint64_t offset;      // position of the next window
+	uint8_t *map;
+
+	// submitted reads, completed in submission order
+	freader_req_t reqs[FREADER_MAX_PENDING];
+	int head;
+	int pending;
+	uint64_t submit_offset;
+	bool eof;             // reads up to the end of the file have been submitted
+
+	// uring mode
+	struct uring* ring;
+	uint8_t* bufs[FREADER_URING_BUFFERS];  // page aligned
+	bool registered;
+	int handed_out;       // buffer returned by the last freader_next(), -1 if none
+} freader_t;
+
+// returns NULL if the file can't be opened
+freader_t* freader_open(const char* filename, freader_mode_t mode);
+
+// returns the size of the next window of up to len bytes, 0 at EOF
+// > *window points into the mapping or to buf, which must hold len bytes
+// > windows are only shorter than len at the end of the file
+size_t freader_next(freader_t* r, uint8_t* buf, size_t len, const uint8_t** window);
+
+// positional version of freader_next(), doesn't move the position
+// > may be called from several threads at once, each with its own buf
+size_t freader_pread(freader_t* r, uint8_t* buf, size_t len, uint64_t offset,
+	const uint8_t** window);
+
+// Asynchronous reads into the caller's buffers, in file order
+// > only uring mode really reads in the background, the other modes read
+//   synchronously on submit so the callers need just one loop
+// > submit reads up to len bytes at the current position, up to
+//   FREADER_MAX_PENDING reads can be pending
+// > complete blocks until the oldest pending read is done
+void   freader_submit(freader_t* r, uint8_t* buf, size_t len);
+size_t freader_complete(freader_t* r, uint8_t** buf);
+// true if freader_complete() wouldn't block
+bool   freader_ready(freader_t* r);
+
+void freader_close(freader_t* r);
+
+// buffers suitable for every engine, free() them
+uint8_t* freader_alloc(size_t len);
+
+// "auto", "read", "mmap", "uring", "direct", returns -1 for unknown names
+int freader_parse_mode(const char* name);
@@ -0,0 +1,160 @@
+#include "libblaketree.h"
+#include "BlakeTreeCPU.h"
+#include "BlakeTreeGPU.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+struct blakeTreeHash {
+	blakeTreeBackend_t backend;
+	blakeTree_t tree;
+	uint64_t length;
+
+	// CPU: partial chunk and the leaf hashes of one chunk
+	uint8_t* buf;
+	size_t buf_fill;
+	uint8_t* stage1;
+
+	// GPU: chunk buffer being filled, NULL if none
+	uint8_t* src;
+	size_t src_fill;
+};
+
+
+blakeTreeHash_t* blakeTreeHash_init(blakeTreeBackend_t backend, int fanout, int height)
+{
+	blakeTreeHash_t* h = calloc(1, sizeof(blakeTreeHash_t));
+	if(!h) {
+		loggerf(ERROR, "Out of memory");
+		exit(1);
+	}
+
+	h->backend = backend;
+	blakeTree_init(&h->tree, fanout, height);
+
+	if(backend == BLAKETREE_GPU) {
+		blakeTreeGPU_init(fanout, height, GPU_DEFAULT_DEPTH);
+	} else {
+		h->buf    = malloc(bt_chunk_size);
+		h->stage1 = malloc(bt_stage1_size);
+		if(!h->buf || !h->stage1) {
+			loggerf(ERROR, "Out of memory");
+			exit(1);
+		}
+	}
+	return h;
+}
+
+
+// hand the oldest GPU result to the tree
+// > returns 0 if nothing is in flight
+static int gpu_drain(blakeTreeHash_t* h)
+{
+	size_t dst_size;
+	int level;
+	uint8_t* dst = blakeTreeGPU_acquire_dst(&dst_size, &level);
+	if(!dst) {
+		return 0;
+	}
+	blakeTree_update_level(&h->tree, level, dst, dst_size);
+	blakeTreeGPU_release_dst();
+	return 1;
+}
+
+
+static void gpu_update(blakeTreeHash_t* h, const uint8_t* in, size_t len)
+{
+	size_t n;
+
+	while(len) {
+		// blocks while the queue is full
+		while(!h->src && !(h->src = blakeTreeGPU_acquire_src())) {
+			gpu_drain(h);
+		}
+
+		n = (bt_chunk_size - h->src_fill < len) ? bt_chunk_size - h->src_fill : len;
+		memcpy(h->src + h->src_fill, in, n);
+		h->src_fill += n;
+		in  += n;
+		len -= n;
+
+		if(h->src_fill == bt_chunk_size) {
+			blakeTreeGPU_enqueue_src(h->src_fill);
+			h->src = NULL;
+			h->src_fill = 0;
+		}
+	}
+}
+
+
+// len is a whole chunk, or the rest at the end
+static void cpu_hash(blakeTreeHash_t* h, const uint8_t* in, size_t len)
+{
+	size_t stage1_size;
+
+	blakeTreeCPU(in, len, bt_leaf_size, h->stage1, &stage1_size);
+	blakeTree_update(&h->tree, h->stage1, stage1_size);
+}
+
+
+static void cpu_update(blakeTreeHash_t* h, const uint8_t* in, size_t len)
+{
+	size_t n;
+
+	// complete a chunk left over from the last updates
+	if(h->buf_fill) {
+		n = (bt_chunk_size - h->buf_fill < len) ? bt_chunk_size - h->buf_fill : len;
+		memcpy(h->buf + h->buf_fill, in, n);
+		h->buf_fill += n;
+		in  += n;
+		len -= n;
+
+		if(h->buf_fill < bt_chunk_size) {
+			return;
+		}
+		cpu_hash(h, h->buf, bt_chunk_size);
+		h->buf_fill = 0;
+	}
+
+	for(; len >= bt_chunk_size; in += bt_chunk_size, len -= bt_chunk_size) {
+		cpu_hash(h, in, bt_chunk_size);
+	}
+
+	memcpy(h->buf, in, len);
+	h->buf_fill = len;
+}
+
+
+void blakeTreeHash_update(blakeTreeHash_t* h, const uint8_t* in, size_t len)
+{
+	h->length += len;
+
+	if(h->backend == BLAKETREE_GPU) {
+		gpu_update(h, in, len);
+	} else {
+		cpu_update(h, in, len);
+	}
+}
+
+
+void blakeTreeHash_final(blakeTreeHash_t* h, uint8_t* out)
+{
+	if(h->backend == BLAKETREE_GPU) {
+		if(h->src) {
+			blakeTreeGPU_enqueue_src(h->src_fill);
+		}
+		while(gpu_drain(h));
+		blakeTreeGPU_close();
+	} else {
+		if(h->buf_fill) {
+			cpu_hash(h, h->buf, h->buf_fill);
+		}
+		free(h->buf);
+		free(h->stage1);
+	}
+
+	blakeTree_final(&h->tree, h->length, out);
+	free(h);
+}
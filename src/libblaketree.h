@@ -0,0 +1,30 @@
+#pragma once
+
+// libblaketree: streaming tree hash
+//
+// Hashes data that is already in memory, in pieces of any size. Gives the
+// same result as blaketree for a file with the same content and settings.
+// The geometry (blakeTree_set_geometry()) and the CPU implementation are
+// process wide and must not change while a context is in use.
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum {
+	BLAKETREE_CPU,
+	BLAKETREE_GPU,  // only one GPU context at a time
+} blakeTreeBackend_t;
+
+typedef struct blakeTreeHash blakeTreeHash_t;
+
+// fanout and height as for blakeTree_init(), 0 and 0 for cake mode
+blakeTreeHash_t* blakeTreeHash_init(blakeTreeBackend_t backend, int fanout, int height);
+
+// > CPU: whole chunks are hashed straight from in, smaller pieces are
+//   collected into a chunk first, so small updates don't start the OpenMP
+//   threads every time
+// > GPU: the data is copied into the chunk buffers of the GPU pipeline
+void blakeTreeHash_update(blakeTreeHash_t* h, const uint8_t* in, size_t len);
+
+// writes the 32 byte root hash and frees the context
+void blakeTreeHash_final(blakeTreeHash_t* h, uint8_t* out);
@@ -1,13 +1,17 @@
 // Calling this implementation tree hashing is borderline to lying.
 // Cake hashing maybe?
-//
-// Ideas:
-// - consider using mmap() instead of fread() for real files
 #define _BSD_SOURCE
 
 #include "BlakeTreeCPU.h"
 #include "BlakeTreeGPU.h"
+#include "BlakeTreePipeline.h"
+#include "file-reader.h"
+#include "libblaketree.h"
 #include "log.h"
+#include "profile.h"
+#include "stats.h"
+#include "trace.h"
+#include "workload.h"
 
 #include <unistd.h>
 #include <stdlib.h>
@@ -19,16 +23,64 @@
 #include <sys/time.h>
 
 void usage() {
-	fprintf(stderr, "Usage: blaketree [-c] [-t] name\n");
+	fprintf(stderr, "Usage: blaketree [-c] [-t] [-b impl] [-i engine] [-q depth] [-j readers] [-F fanout] [-H height] [-L leaf] [-S chunk] [-k kernel] [-w local] [-m transfer] [-x share] [-g devices] [-s] [-T trace] name\n");
+	fprintf(stderr, "       blaketree --autotune [-c] [-L leaf] [name]\n");
 	fprintf(stderr, "  -C   Use CPU\n");
 	fprintf(stderr, "  -t   Test mode\n");
 	fprintf(stderr, "  -v   Verbose\n");
+	fprintf(stderr, "  -s   --stats: per-stage timings and percentiles on stderr\n");
+	fprintf(stderr, "  --autotune: find the fastest settings, reading name (default: a temporary\n");
+	fprintf(stderr, "       file), and save them to the profile of this machine (also %s),\n",
+		PROFILE_ENV);
+	fprintf(stderr, "       -c tunes the CPU only\n");
+	fprintf(stderr, "  -T   Write a Chrome trace of the pipeline to the file (also %s)\n",
+		TRACE_ENV);
+	fprintf(stderr, "  -b   Force a CPU implementation (also %s):\n      ",
+		BLAKE256_IMPL_ENV);
+	for(const blake256_impl_t *impl = blake256_impls; impl->name; impl++) {
+		fprintf(stderr, " %s", impl->name);
+	}
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -i   input engine: auto, read, mmap, uring, direct (GPU: read, uring, direct)\n");
+	fprintf(stderr, "  -q   Pipeline depth in chunks, 1 disables the CPU pipeline (default: %d)\n",
+		PIPELINE_DEFAULT_DEPTH);
+	fprintf(stderr, "  -j   CPU pipeline reader threads, reading chunks concurrently (default: 1)\n");
+	fprintf(stderr, "  -F   Tree mode with the given fanout (default: 0, cake mode)\n");
+	fprintf(stderr, "  -H   Tree mode height limit including leaves and root (default: 0, unlimited)\n");
+	fprintf(stderr, "  -L   Leaf size in bytes, a multiple of 64, k/m suffixes (default: %d)\n",
+		BT_DEFAULT_LEAF_SIZE);
+	fprintf(stderr, "  -S   Chunk size in bytes, a multiple of the leaf size (default: %d)\n",
+		BT_DEFAULT_CHUNK_SIZE);
+	fprintf(stderr, "  -k   GPU leaf kernel: staged, simple (default: staged)\n");
+	fprintf(stderr, "  -w   Work-group size of the simple GPU kernel (default: 0, the device's)\n");
+	fprintf(stderr, "  -m   GPU transfers: map (pinned memory), copy (default: map)\n");
+	fprintf(stderr, "  -g   GPU devices: all or indices like 0,2 (default: all)\n");
+	fprintf(stderr, "  -x   Hybrid: GPU share of the leaves 0..1 or auto, the CPU hashes the rest\n");
 	exit(EXIT_FAILURE);
 }
+static freader_mode_t input_mode = FREADER_AUTO;
+static int pipeline_depth = PIPELINE_DEFAULT_DEPTH;
+static int pipeline_readers = 1;
+static int tree_fanout = 0;
+static int tree_height = 0;
+static size_t leaf_size = BT_DEFAULT_LEAF_SIZE;
+static size_t chunk_size = BT_DEFAULT_CHUNK_SIZE;
+
+// set by options, which win over the profile
+static bool impl_set, depth_set, chunk_set, kernel_set, local_set;
+
 void action_file_cpu(char* filename);
 void action_file_gpu(char* filename);
+void action_tune(char* filename, bool gpu);
+void apply_profile(bool gpu);
 
 void action_test();
+void test_cpu();
+void test_cpu_leaves();
+void test_tree();
+void test_lib(blakeTreeBackend_t backend);
+void test_dispatch();
+void test_gpu_hashes();
 void test_gpu();
 
 
@@ -53,14 +105,22 @@ double stopwatch_peek(stopwatch_t *sw) {
 
 int main(int argc, char** argv) {
 	int flags, opt;
+	char* end;
 
 	enum cmd_opts {
 		FLAG_TEST    = 0x01,
 		FLAG_CPU     = 0x02,
+		FLAG_TUNE    = 0x04,
+	};
+
+	static const struct option long_opts[] = {
+		{ "stats", no_argument, NULL, 's' },
+		{ "autotune", no_argument, NULL, 'A' },
+		{ NULL, 0, NULL, 0 }
 	};
 
 	flags = 0;
-	while ((opt = getopt(argc, argv, "tcvh")) != -1) 
+	while ((opt = getopt_long(argc, argv, "tcvshb:i:q:j:F:H:L:S:k:w:m:x:g:T:", long_opts, NULL)) != -1) 
 	{
 		switch (opt) 
 		{
@@ -73,14 +133,150 @@ int main(int argc, char** argv) {
 		case 'v':
 			logger_level = DEBUG;
 			break;
+		case 's':
+			stats_enabled = true;
+			break;
+		case 'A':
+			flags |= FLAG_TUNE;
+			break;
+		case 'T':
+			if(!trace_open(optarg)) {
+				loggerf(ERROR, "Can't write the trace to %s", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'b':
+			if(!blake256_select_impl(optarg)) {
+				loggerf(ERROR, "CPU implementation \"%s\" is unknown or not supported", 
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			impl_set = true;
+			break;
+		case 'i':
+			if(freader_parse_mode(optarg) < 0) {
+				usage();
+			}
+			input_mode = freader_parse_mode(optarg);
+			break;
+		case 'q':
+			pipeline_depth = atoi(optarg);
+			if(pipeline_depth < 1) {
+				usage();
+			}
+			depth_set = true;
+			break;
+		case 'j':
+			pipeline_readers = atoi(optarg);
+			if(pipeline_readers < 1) {
+				usage();
+			}
+			break;
+		case 'F':
+			tree_fanout = atoi(optarg);
+			if(tree_fanout < 2) {
+				usage();
+			}
+			break;
+		case 'H':
+			tree_height = atoi(optarg);
+			if(tree_height < 2 || tree_height > BT_MAX_LEVELS) {
+				usage();
+			}
+			break;
+		case 'L':
+			leaf_size = blakeTree_parse_size(optarg);
+			break;
+		case 'S':
+			chunk_size = blakeTree_parse_size(optarg);
+			chunk_set = true;
+			break;
+		case 'k':
+			if(!blakeTreeGPU_select_kernel(optarg)) {
+				usage();
+			}
+			kernel_set = true;
+			break;
+		case 'w':
+			// 0 is valid, the device's size
+			if(*optarg < '0' || *optarg > '9') {
+				usage();
+			}
+			blakeTreeGPU_set_local(strtoul(optarg, &end, 10));
+			if(*end != 0) {
+				usage();
+			}
+			local_set = true;
+			break;
+		case 'm':
+			if(!blakeTreeGPU_select_transfer(optarg)) {
+				usage();
+			}
+			break;
+		case 'g':
+			if(!blakeTreeGPU_select_devices(optarg)) {
+				usage();
+			}
+			break;
+		case 'x':
+			if(!blakeTreeGPU_set_hybrid(optarg)) {
+				usage();
+			}
+			break;
 		default: /* '?' */
 			usage();
 		}
 	}
 
-	loggerf(DEBUG, "Blake-256 CPU implementation: %s", BLAKE256_CPU_IMPL);
+	const char* trace_path = getenv(TRACE_ENV);
+	if(trace_path && *trace_path && !trace_open(trace_path)) {
+		loggerf(ERROR, "Can't write the trace to %s", trace_path);
+		exit(EXIT_FAILURE);
+	}
+	trace_thread_name("main");
+
+	const char* schedule = getenv("OMP_SCHEDULE");
+	if(schedule && !blakeTreeCPU_set_schedule(schedule)) {
+		loggerf(ERROR, "OMP_SCHEDULE: invalid schedule \"%s\"", schedule);
+		exit(EXIT_FAILURE);
+	}
+	if(!(flags & (FLAG_TEST | FLAG_TUNE)) && optind < argc) {
+		apply_profile(!(flags & FLAG_CPU));
+	}
 
-	if (!(flags & FLAG_TEST)) 
+	// the reader threads are a stage of the CPU pipeline
+	if(pipeline_readers > 1 && 
+		(!(flags & FLAG_CPU) || pipeline_depth == 1 || input_mode == FREADER_URING)) 
+	{
+		loggerf(ERROR, "-j needs the CPU pipeline: -c, -q 2 or more and no -i uring");
+		exit(EXIT_FAILURE);
+	}
+
+	loggerf(DEBUG, "Blake-256 CPU implementation: %s, %d leaf lanes", 
+		BLAKE256_CPU_IMPL, BLAKE256_LEAF_LANES);
+
+	if(tree_height && !tree_fanout) {
+		usage();
+	}
+	if(!blakeTree_set_geometry(leaf_size, chunk_size)) {
+		loggerf(ERROR, "Invalid leaf size %zu or chunk size %zu", leaf_size, chunk_size);
+		exit(EXIT_FAILURE);
+	}
+	loggerf(DEBUG, "Leaf size: %zu, chunk size: %zu", bt_leaf_size, bt_chunk_size);
+	// every chunk is read at its own offset, unaligned ones bypass O_DIRECT
+	if(input_mode == FREADER_DIRECT && bt_chunk_size % FREADER_ALIGN != 0) {
+		loggerf(ERROR, "-i direct needs a chunk size that is a multiple of %d", FREADER_ALIGN);
+		exit(EXIT_FAILURE);
+	}
+	if(tree_fanout) {
+		loggerf(DEBUG, "Tree mode, fanout: %d, height: %d", tree_fanout, tree_height);
+	}
+
+	if(flags & FLAG_TUNE)
+	{
+		action_tune(optind < argc ? argv[optind] : NULL, !(flags & FLAG_CPU));
+	}
+	else if (!(flags & FLAG_TEST)) 
 	{
 		if(optind >= argc) 
 		{
@@ -105,6 +301,81 @@ int main(int argc, char** argv) {
 }
 
 
+// the tuned settings of this machine, see profile.h
+// > the CPU section applies to GPU runs as well, they hash on the CPU too
+void apply_profile(bool gpu)
+{
+	char key[PROFILE_KEY_SIZE];
+	profile_t p;
+
+	for(int part = 0; part <= gpu; part++) {
+		profile_key(part, key, sizeof(key));
+		if(!profile_load(key, &p)) {
+			loggerf(DEBUG, "No profile for %s", key);
+			continue;
+		}
+		loggerf(DEBUG, "Profile: %s", key);
+
+		if(p.impl[0] && !impl_set && !getenv(BLAKE256_IMPL_ENV) && 
+			!blake256_select_impl(p.impl)) 
+		{
+			loggerf(ERROR, "Profile: CPU implementation \"%s\" is unknown or not supported", 
+				p.impl);
+		}
+		if(p.threads && !getenv("OMP_NUM_THREADS")) {
+			blakeTreeCPU_set_threads(p.threads);
+		}
+		if(p.schedule[0] && !getenv("OMP_SCHEDULE") && !blakeTreeCPU_set_schedule(p.schedule)) {
+			loggerf(ERROR, "Profile: invalid schedule \"%s\"", p.schedule);
+		}
+		if(p.kernel[0] && !kernel_set && !blakeTreeGPU_select_kernel(p.kernel)) {
+			loggerf(ERROR, "Profile: unknown GPU kernel \"%s\"", p.kernel);
+		}
+		if(p.kernel[0] && !local_set) {
+			blakeTreeGPU_set_local(p.local);
+		}
+
+		// the GPU section decides for GPU runs
+		// > a chunk size tuned for another leaf size may not fit
+		if(part == gpu) {
+			if(p.chunk && !chunk_set && p.chunk % leaf_size == 0) {
+				chunk_size = p.chunk;
+			}
+			if(p.depth && !depth_set) {
+				pipeline_depth = p.depth;
+			}
+		}
+	}
+}
+
+
+// search the fastest settings of this machine and save them in its profile
+void action_tune(char* filename, bool gpu)
+{
+	char key[PROFILE_KEY_SIZE];
+	profile_t p;
+
+	if(filename && access(filename, R_OK) != 0) {
+		loggerf(ERROR, "Can't open %s", filename);
+		exit(1);
+	}
+
+	for(int part = 0; part <= gpu; part++) {
+		if(part) {
+			profile_tune_gpu(&p);
+		} else {
+			profile_tune_cpu(filename, &p);
+		}
+		profile_key(part, key, sizeof(key));
+		if(!profile_save(key, &p)) {
+			loggerf(ERROR, "Can't save the profile, see %s", PROFILE_ENV);
+			exit(1);
+		}
+		loggerf(INFO, "Saved the profile for %s", key);
+	}
+}
+
+
 void hash2str(uint8_t* hash, char* out) {
 	int i;
 	char buf[HASH_LEN * 2 + 1];
@@ -117,64 +388,102 @@ void hash2str(uint8_t* hash, char* out) {
 
 
 void action_file_cpu(char* filename) {
-	state256 master_state;
+	blakeTree_t master_state;
 	uint8_t  master_hash[HASH_LEN];
 	char     master_hash_str[HASH_LEN * 2 + 1];
 	uint8_t *src, *dst;
+	const uint8_t *window;
 	size_t  dst_size;
 
-	FILE* f;
+	freader_t* r;
 	size_t bytes_read;
 	uint64_t total_bytes_read;
 
 	stopwatch_t sw;
 
-	f = fopen(filename, "r");
-	assert(f);
+	r = freader_open(filename, input_mode);
+	if(!r) {
+		loggerf(ERROR, "Can't open %s", filename);
+		exit(1);
+	}
 	total_bytes_read = 0;
 
-	blake256_init(&master_state);
-
-	src = malloc(FILE_BUFFER_SIZE);
-	dst = malloc(STAGE1_SIZE);
+	blakeTree_init(&master_state, tree_fanout, tree_height);
 
 	stopwatch_start(&sw);
 
-	while( (bytes_read = fread(src, 1, FILE_BUFFER_SIZE, f)) )
+	// uring reads ahead by itself
+	if(pipeline_depth > 1 && r->mode != FREADER_URING) 
 	{
-		total_bytes_read += bytes_read;
-		blakeTreeCPU(src, bytes_read, dst, &dst_size);
-		blake256_update(&master_state, dst, dst_size);
+		total_bytes_read = blakeTreePipeline_run(r, pipeline_depth, pipeline_readers,
+			&master_state);
+	}
+	else
+	{
+		// mapped files are hashed in place
+		src = (r->mode == FREADER_MMAP) ? NULL : freader_alloc(bt_chunk_size);
+		dst = malloc(bt_stage1_size);
+
+		double t = stats_now();
+		uint64_t trace = trace_begin();
+		while( (bytes_read = freader_next(r, src, bt_chunk_size, &window)) )
+		{
+			total_bytes_read += bytes_read;
+			stats_add(STATS_READ, stats_now() - t, bytes_read);
+			trace_end("read", trace, bytes_read);
+
+			t = stats_now();
+			blakeTreeCPU(window, bytes_read, bt_leaf_size, dst, &dst_size);
+			stats_add(STATS_CPU, stats_now() - t, bytes_read);
+
+			t = stats_now();
+			blakeTree_update(&master_state, dst, dst_size);
+			stats_add(STATS_MASTER, stats_now() - t, bytes_read);
+			t = stats_now();
+			trace = trace_begin();
+		}
+
+		free(src);
+		free(dst);
 	}
 
-	fclose(f);
+	freader_close(r);
 
-	blake256_final(&master_state, master_hash);
+	blakeTree_final(&master_state, total_bytes_read, master_hash);
 	hash2str(master_hash, master_hash_str);
 	logger(INFO, master_hash_str);
 	stopwatch_peek(&sw);
 	loggerf(DEBUG, "%.1f MiB/s", (total_bytes_read >> 20) / sw.sec);
+	stats_report(sw.sec);
 }
 
 
 void action_file_gpu(char* filename) {
-	state256 master_state;
+	blakeTree_t master_state;
 	uint8_t  master_hash[HASH_LEN];
 	char     master_hash_str[HASH_LEN * 2 + 1];
 	uint8_t *src, *dst;
 
-	FILE* f;
+	freader_t* r;
 	size_t bytes_read;
 	uint64_t total_bytes_read;
 	bool eof, done;
 
 	stopwatch_t sw;
 
-	f = fopen(filename, "r");
-	assert(f);
+	// the GPU buffers are filled by reads, never mapped
+	r = freader_open(filename, 
+		(input_mode == FREADER_URING || input_mode == FREADER_DIRECT) ? input_mode : FREADER_READ);
+	if(!r) {
+		loggerf(ERROR, "Can't open %s", filename);
+		exit(1);
+	}
 	
-	blake256_init(&master_state);
-	blakeTreeGPU_init();
+	blakeTree_init(&master_state, tree_fanout, tree_height);
+	if(input_mode == FREADER_DIRECT) {
+		blakeTreeGPU_align_src(FREADER_ALIGN);
+	}
+	blakeTreeGPU_init(tree_fanout, tree_height, pipeline_depth);
 
 	total_bytes_read = 0;
 	done = eof = false;
@@ -184,41 +493,227 @@ void action_file_gpu(char* filename) {
 	{
 		// read result
 		size_t dst_size; 
-		dst = blakeTreeGPU_acquire_dst(&dst_size);
+		int level;
+		dst = blakeTreeGPU_acquire_dst(&dst_size, &level);
 		if(dst) {
-			blake256_update(&master_state, dst, dst_size);
+			// about the input bytes behind the hashes
+			size_t covered = (dst_size / HASH_LEN) * bt_leaf_size * (level ? tree_fanout : 1);
+			double t = stats_now();
+			blakeTree_update_level(&master_state, level, dst, dst_size);
+			stats_add(STATS_MASTER, stats_now() - t, covered);
 			blakeTreeGPU_release_dst();
 		} else {
-			if(eof) 
+			if(eof && r->pending == 0) 
 			{
 				done = true;
 			}
 		}
 			
 
-		// push N new buffers
+		// submit reads into N new buffers
 		// blocks if queue is full
-		while(!eof && (src = blakeTreeGPU_acquire_src()))
+		while(!eof && r->pending < FREADER_MAX_PENDING && (src = blakeTreeGPU_acquire_src()))
 		{
-			bytes_read = fread(src, 1, FILE_BUFFER_SIZE, f);
-			total_bytes_read += bytes_read;
-			if(bytes_read == 0) 
-			{
-				eof = true;
+			freader_submit(r, src, bt_chunk_size);
+			eof = r->eof;
+		}
+
+		// enqueue the filled buffers
+		// > only wait for a read if the GPU has nothing else to do
+		while(r->pending && 
+			(freader_ready(r) || blakeTreeGPU_pending() == r->pending))
+		{
+			// the GPU waits for the read
+			double t = stats_now();
+			bool idle = !freader_ready(r);
+			bytes_read = freader_complete(r, NULL);
+			if(idle) {
+				stats_add(STATS_IDLE, stats_now() - t, 0);
 			}
+			total_bytes_read += bytes_read;
 			blakeTreeGPU_enqueue_src(bytes_read);
 		}
 	}
 
-	fclose(f);
+	freader_close(r);
 	blakeTreeGPU_close();
 
-	blake256_final(&master_state, master_hash);
+	blakeTree_final(&master_state, total_bytes_read, master_hash);
 	hash2str(master_hash, master_hash_str);
 	logger(INFO, master_hash_str);
 
 	stopwatch_peek(&sw);
 	loggerf(DEBUG, "%.1f MiB/s", (total_bytes_read >> 20) / sw.sec);
+	stats_report(sw.sec);
+}
+
+
+// hash length bytes through the GPU ring, like action_file_gpu()
+// > the leaf hashes go to stage1 as long as the GPU doesn't reduce them
+// > returns the number of chunks the GPU reduced to level 1 nodes
+static size_t gpu_tree_hash(const uint8_t* data, size_t length, int fanout, int height,
+	uint8_t* stage1, uint8_t* root)
+{
+	size_t chunks = (length + bt_chunk_size - 1) / bt_chunk_size;
+	size_t submitted = 0, completed = 0, stage1_size = 0, reduced = 0;
+	blakeTree_t tree;
+	uint8_t *src, *dst;
+
+	blakeTree_init(&tree, fanout, height);
+	blakeTreeGPU_init(fanout, height, 2);
+	while(completed < chunks) {
+		size_t dst_size;
+		int level;
+		if((dst = blakeTreeGPU_acquire_dst(&dst_size, &level))) {
+			if(level == 0) {
+				memcpy(&stage1[stage1_size], dst, dst_size);
+				stage1_size += dst_size;
+			} else {
+				reduced++;
+			}
+			blakeTree_update_level(&tree, level, dst, dst_size);
+			blakeTreeGPU_release_dst();
+			completed++;
+		}
+		while(submitted < chunks && (src = blakeTreeGPU_acquire_src())) {
+			size_t offset = submitted * bt_chunk_size;
+			size_t len = (length - offset < bt_chunk_size) ? length - offset : bt_chunk_size;
+			memcpy(src, &data[offset], len);
+			blakeTreeGPU_enqueue_src(len);
+			submitted++;
+		}
+	}
+	blakeTreeGPU_close();
+	blakeTree_final(&tree, length, root);
+	return reduced;
+}
+
+
+// the GPU ring must produce the leaf hashes and the root of the CPU for
+// length bytes of data, expected and stage1 are scratch space
+// > full chunks are reduced unless the CPU hashes a share of them
+static bool check_gpu_hash(const uint8_t* data, size_t length, int fanout, int height,
+	bool hybrid, uint8_t* stage1, uint8_t* expected)
+{
+	uint8_t root[HASH_LEN], expected_root[HASH_LEN];
+	size_t stage1_size;
+	blakeTree_t tree;
+
+	size_t full_chunks = (fanout && !hybrid) ? length / bt_chunk_size : 0;
+
+	blakeTreeCPU(data, length, bt_leaf_size, expected, &stage1_size);
+	blakeTree_init(&tree, fanout, height);
+	blakeTree_update(&tree, expected, stage1_size);
+	blakeTree_final(&tree, length, expected_root);
+
+	memset(stage1, 0, stage1_size);
+	size_t reduced = gpu_tree_hash(data, length, fanout, height, stage1, root);
+
+	// leaf hashes are only compared if the GPU didn't reduce them
+	bool leaves_match = full_chunks > 0 || memcmp(stage1, expected, stage1_size) == 0;
+	return leaves_match && reduced == full_chunks && memcmp(root, expected_root, HASH_LEN) == 0;
+}
+
+
+// the GPU must produce the hashes of the CPU
+// > every leaf kernel and several leaf sizes, the specialized ones and the
+//   generic kernel, random data
+// > chunks of a leaf count that isn't a multiple of the staged work-group
+// > tree mode: full chunks are reduced to level 1 nodes on the GPU, a short
+//   last chunk isn't, the roots must match either way
+// > partial last leaves around the padding boundaries: shorter than 56
+//   bytes, 56..63 (the length spills into another block) and several blocks
+// > the hybrid split with a few GPU shares, nothing is reduced then
+// > runs on any OpenCL device, e.g. BLAKETREE_CL_DEVICE=cpu
+void test_gpu_hashes()
+{
+	const char* kernels[] = { "staged", "simple", NULL };
+	const size_t leaf_sizes[] = { 64, 192, 1024, 2048, 4096, 8192 };
+	const char* shares[] = { "0", "0.5", "1", "auto", NULL };
+	const size_t share_leaf_sizes[] = { 64, 4096 };
+	const size_t chunk_leaves = 208;   // 3.25 work-groups of 64
+	const size_t saved_leaf = bt_leaf_size, saved_chunk = bt_chunk_size;
+	uint8_t *data, *stage1, *expected;
+	size_t i;
+
+	// cases: tree shape, leaves per chunk, input length in leaves and bytes
+	// > LEAF_LESS_ONE: a last leaf one byte short of a full one
+	const size_t LEAF_LESS_ONE = (size_t) -1;
+	const struct { int fanout, height; size_t chunk, leaves, extra; } cases[] = {
+		{  0, 0, chunk_leaves, 3 * chunk_leaves, 0 },
+		{  0, 0, chunk_leaves, 2 * chunk_leaves + 77, 0 },
+		{  0, 0, chunk_leaves, 5, 0 },
+		{ 16, 0, chunk_leaves, 3 * chunk_leaves, 0 },
+		{ 16, 0, chunk_leaves, 2 * chunk_leaves + 77, 0 },
+		{ 64, 3, 256, 3 * 256, 0 },
+		{ 64, 3, 256, 2 * 256 + 64, 0 },
+		{  0, 0, chunk_leaves, 2 * chunk_leaves + 3, 1 },
+		{  0, 0, chunk_leaves, 2 * chunk_leaves + 3, 55 },
+		{  0, 0, chunk_leaves, 2 * chunk_leaves + 3, 56 },
+		{  0, 0, chunk_leaves, 2 * chunk_leaves + 3, 63 },
+		{  0, 0, chunk_leaves, 2 * chunk_leaves + 3, 64 },
+		{  0, 0, chunk_leaves, 2 * chunk_leaves + 3, 65 },
+		{  0, 0, chunk_leaves, 2 * chunk_leaves + 3, LEAF_LESS_ONE },
+		{  0, 0, chunk_leaves, 0, 55 },
+		{ 16, 0, chunk_leaves, 3 * chunk_leaves, 55 },
+		{ 16, 0, chunk_leaves, 2 * chunk_leaves + 3, LEAF_LESS_ONE },
+	};
+	const size_t max_length = 4 * 256 * 8192;
+
+	srand(1234);
+	data     = malloc(max_length);
+	stage1   = malloc((max_length / 64 + 1) * HASH_LEN);
+	expected = malloc((max_length / 64 + 1) * HASH_LEN);
+	for(i=0; i < max_length; i++) {
+		data[i] = (uint8_t) rand();
+	}
+
+	blakeTreeGPU_set_hybrid(NULL);
+	for(int k=0; kernels[k]; k++) {
+		blakeTreeGPU_select_kernel(kernels[k]);
+		for(int l=0; l < sizeof(leaf_sizes)/sizeof(size_t); l++) {
+			for(int c=0; c < sizeof(cases)/sizeof(cases[0]); c++) {
+				blakeTree_set_geometry(leaf_sizes[l], cases[c].chunk * leaf_sizes[l]);
+				size_t length = cases[c].leaves * bt_leaf_size + 
+					(cases[c].extra == LEAF_LESS_ONE ? bt_leaf_size - 1 : cases[c].extra);
+				if(!check_gpu_hash(data, length, cases[c].fanout, cases[c].height, false,
+					stage1, expected)) 
+				{
+					loggerf(ERROR, "GPU hash invalid, kernel: %s, leaf size: %zu, length: %zu, "
+						"fanout: %d, height: %d", kernels[k], bt_leaf_size, length, 
+						cases[c].fanout, cases[c].height);
+					exit(1);
+				}
+			}
+		}
+	}
+
+	blakeTreeGPU_select_kernel("staged");
+	for(int h=0; shares[h]; h++) {
+		blakeTreeGPU_set_hybrid(shares[h]);
+		for(int l=0; l < sizeof(share_leaf_sizes)/sizeof(size_t); l++) {
+			for(int c=0; c < sizeof(cases)/sizeof(cases[0]); c++) {
+				blakeTree_set_geometry(share_leaf_sizes[l], cases[c].chunk * share_leaf_sizes[l]);
+				size_t length = cases[c].leaves * bt_leaf_size + 
+					(cases[c].extra == LEAF_LESS_ONE ? bt_leaf_size - 1 : cases[c].extra);
+				if(!check_gpu_hash(data, length, cases[c].fanout, cases[c].height, true,
+					stage1, expected)) 
+				{
+					loggerf(ERROR, "GPU hash invalid, hybrid share: %s, leaf size: %zu, "
+						"length: %zu, fanout: %d, height: %d", shares[h], bt_leaf_size, length, 
+						cases[c].fanout, cases[c].height);
+					exit(1);
+				}
+			}
+		}
+	}
+	blakeTreeGPU_set_hybrid(NULL);
+	logger(INFO, "GPU hashes are valid");
+
+	blakeTree_set_geometry(saved_leaf, saved_chunk);
+	free(data);
+	free(stage1);
+	free(expected);
 }
 
 
@@ -228,21 +723,21 @@ void test_gpu()
 	uint8_t *src, *dst;
 	stopwatch_t sw;
 
-	blakeTreeGPU_init();
+	blakeTreeGPU_init(0, 0, pipeline_depth);
 	stopwatch_start(&sw);
 	
 	while(sw.msec < 5000)
 	{
-		dst = blakeTreeGPU_acquire_dst(NULL);
+		dst = blakeTreeGPU_acquire_dst(NULL, NULL);
 		if(dst) {
 			blakeTreeGPU_release_dst();
 		}
 
 		while((src = blakeTreeGPU_acquire_src()))
 		{
-			total_bytes_read += FILE_BUFFER_SIZE;
-			memset(src, 0, FILE_BUFFER_SIZE);
-			blakeTreeGPU_enqueue_src(FILE_BUFFER_SIZE);
+			total_bytes_read += bt_chunk_size;
+			memset(src, 0, bt_chunk_size);
+			blakeTreeGPU_enqueue_src(bt_chunk_size);
 		}
 
 		stopwatch_peek(&sw);
@@ -253,7 +748,231 @@ void test_gpu()
 }
 
 
+// the multi-buffer leaf hashes must match the plain hash of every leaf
+// > for the specialized leaf sizes and a few others
+void test_cpu_leaves()
+{
+	const size_t leaf_sizes[] = { 64, 192, 1024, 2048, 4096, 8192, 8256 };
+	const size_t leaves = 2 * BLAKE256_LEAF_LANES + 3;
+	uint8_t *src, *dst, expected[HASH_LEN];
+	size_t i, dst_size, leaf_len;
+
+	for(int l=0; l < sizeof(leaf_sizes)/sizeof(size_t); l++) {
+		const size_t leaf_size = leaf_sizes[l];
+		const size_t length = leaves * leaf_size + 50;
+
+		src = workload_alloc(length);
+		dst = malloc((leaves + 1) * HASH_LEN);
+
+		blakeTreeCPU(src, length, leaf_size, dst, &dst_size);
+		assert(dst_size == (leaves + 1) * HASH_LEN);
+
+		for(i=0; i <= leaves; i++) {
+			leaf_len = (i < leaves) ? leaf_size : length % leaf_size;
+			blake256_hash(expected, &src[i * leaf_size], leaf_len);
+			if(memcmp(expected, &dst[i * HASH_LEN], HASH_LEN) != 0) {
+				loggerf(ERROR, "CPU leaf hash %d invalid, leaf size %d", 
+					(int)i, (int)leaf_size);
+				exit(1);
+			}
+		}
+
+		free(src);
+		free(dst);
+	}
+
+	// the fixed length leaf hash, multiples of 64 and the generic fallback
+	src = malloc(8192 + 64);
+	for(i=0; i < 8192 + 64; i++) {
+		src[i] = (uint8_t)(i * 17);
+	}
+	for(leaf_len = 0; leaf_len <= 8192 + 64; leaf_len += (leaf_len < 256) ? 1 : 64) {
+		uint8_t result[HASH_LEN];
+		blake256_hash(expected, src, leaf_len);
+		blake256_hash_leaf(result, src, leaf_len);
+		if(memcmp(expected, result, HASH_LEN) != 0) {
+			loggerf(ERROR, "CPU fixed length leaf hash invalid, length %d", (int)leaf_len);
+			exit(1);
+		}
+	}
+	free(src);
+
+	logger(INFO, "CPU leaf hashes are valid");
+}
+
+
+// the tree must not depend on how the leaf hashes are split into updates
+// > checked against a plain level by level computation
+void test_tree()
+{
+	const size_t leaves = 3 * 4096 + 77;
+	const int shapes[][2] = { {2, 0}, {16, 0}, {16, 3}, {64, 2}, {5000, 0} };
+	uint8_t *stage1, *level, *next;
+	uint8_t root[HASH_LEN], expected[HASH_LEN], param[32];
+	blakeTree_t tree;
+	state256 S;
+	size_t i, n, chunk;
+
+	stage1 = malloc(leaves * HASH_LEN);
+	level  = malloc(leaves * HASH_LEN);
+	for(i=0; i < leaves * HASH_LEN; i++) {
+		stage1[i] = (uint8_t)(i * 7 + (i >> 9));
+	}
+
+	for(int s=0; s < sizeof(shapes)/sizeof(shapes[0]); s++) {
+		int fanout = shapes[s][0], height = shapes[s][1], top = 0;
+
+		memcpy(level, stage1, leaves * HASH_LEN);
+		for(n = leaves; n > fanout && !(height && top == height - 2); top++) {
+			next = malloc(((n + fanout - 1) / fanout) * HASH_LEN);
+			for(i=0; i * fanout < n; i++) {
+				size_t children = (n - i * fanout < fanout) ? n - i * fanout : fanout;
+				blake256_hash(&next[i * HASH_LEN], &level[i * fanout * HASH_LEN], 
+					children * HASH_LEN);
+			}
+			memcpy(level, next, i * HASH_LEN);
+			free(next);
+			n = i;
+		}
+		memset(param, 0, sizeof(param));
+		memcpy(param, "BTRE", 4);
+		U32TO8_BIG(param +  4, bt_leaf_size);
+		U32TO8_BIG(param +  8, fanout);
+		U32TO8_BIG(param + 12, height);
+		U32TO8_BIG(param + 16, top);
+		U64TO8_BIG(param + 24, (uint64_t) leaves * bt_leaf_size);
+		blake256_init(&S);
+		blake256_update(&S, level, n * HASH_LEN);
+		blake256_update(&S, param, sizeof(param));
+		blake256_final(&S, expected);
+
+		// odd update sizes
+		blakeTree_init(&tree, fanout, height);
+		for(i=0, chunk=1; i < leaves; i += chunk, chunk = chunk * 3 + 1) {
+			chunk = (leaves - i < chunk) ? leaves - i : chunk;
+			blakeTree_update(&tree, &stage1[i * HASH_LEN], chunk * HASH_LEN);
+		}
+		blakeTree_final(&tree, (uint64_t) leaves * bt_leaf_size, root);
+
+		if(memcmp(root, expected, HASH_LEN) != 0) {
+			loggerf(ERROR, "Tree hash invalid, fanout: %d, height: %d", fanout, height);
+			exit(1);
+		}
+	}
+	logger(INFO, "CPU tree hashes are valid");
+
+	free(stage1);
+	free(level);
+}
+
+
+// the streaming API must match hashing the whole buffer at once
+void test_lib(blakeTreeBackend_t backend)
+{
+	const size_t length = 3 * bt_chunk_size + 5 * bt_leaf_size + 123;
+	const int shapes[][2] = { {0, 0}, {16, 0} };
+	uint8_t *src, *stage1, expected[HASH_LEN], result[HASH_LEN];
+	blakeTreeHash_t* h;
+	blakeTree_t tree;
+	size_t i, n, stage1_size;
+
+	src    = malloc(length);
+	stage1 = malloc((length / bt_leaf_size + 1) * HASH_LEN);
+	for(i=0; i < length; i++) {
+		src[i] = (uint8_t)(i * 13 + (i >> 13));
+	}
+
+	for(int s=0; s < sizeof(shapes)/sizeof(shapes[0]); s++) {
+		blakeTreeCPU(src, length, bt_leaf_size, stage1, &stage1_size);
+		blakeTree_init(&tree, shapes[s][0], shapes[s][1]);
+		blakeTree_update(&tree, stage1, stage1_size);
+		blakeTree_final(&tree, length, expected);
+
+		// odd update sizes, from single bytes to several chunks
+		h = blakeTreeHash_init(backend, shapes[s][0], shapes[s][1]);
+		for(i=0, n=1; i < length; i += n, n = n * 5 + 3) {
+			n = (length - i < n) ? length - i : n;
+			blakeTreeHash_update(h, &src[i], n);
+		}
+		blakeTreeHash_final(h, result);
+
+		if(memcmp(result, expected, HASH_LEN) != 0) {
+			loggerf(ERROR, "Library hash invalid, backend: %s, fanout: %d", 
+				backend == BLAKETREE_GPU ? "GPU" : "CPU", shapes[s][0]);
+			exit(1);
+		}
+	}
+	logger(INFO, "Library hashes are valid");
+
+	free(src);
+	free(stage1);
+}
+
+
+static int supported_never(void) { return 0; }
+static int supported_always(void) { return 1; }
+
+// auto must skip implementations the CPU lacks, a named one must not
+void test_dispatch()
+{
+	const blake256_impl_t table[] = {
+		{ "missing", supported_never },
+		{ "present", supported_always },
+		{ NULL }
+	};
+
+	if(blake256_find_impl(table, NULL) != &table[1] ||
+		blake256_find_impl(table, "auto") != &table[1] ||
+		blake256_find_impl(table, "missing") != NULL ||
+		blake256_find_impl(table, "present") != &table[1] ||
+		blake256_find_impl(table, "unknown") != NULL)
+	{
+		logger(ERROR, "CPU implementation selection invalid");
+		exit(1);
+	}
+
+	// the default is the first one the CPU supports
+	const blake256_impl_t *first = blake256_impls;
+	while(!first->supported()) {
+		first++;
+	}
+	if(blake256_find_impl(blake256_impls, NULL) != first) {
+		logger(ERROR, "CPU implementation selection invalid");
+		exit(1);
+	}
+	logger(INFO, "CPU implementation selection is valid");
+}
+
+
+// checks every CPU implementation the machine supports
 void action_test() {
+	const blake256_impl_t *selected = blake256_impl;
+
+	logger(INFO, "CPU implementation selection test...");
+	test_dispatch();
+
+	for(const blake256_impl_t *impl = blake256_impls; impl->name; impl++) {
+		if(!impl->supported()) {
+			continue;
+		}
+		blake256_impl = impl;
+		loggerf(INFO, "CPU implementation: %s", impl->name);
+		test_cpu();
+	}
+	blake256_impl = selected;
+
+	logger(INFO, "GPU throughput test...");
+	test_gpu();
+
+	logger(INFO, "GPU hash test...");
+	test_gpu_hashes();
+
+	logger(INFO, "GPU library test...");
+	test_lib(BLAKETREE_GPU);
+}
+
+
+void test_cpu() {
 	const size_t test_size = 123;
 	uint8_t in[test_size], out[HASH_LEN];
 	const char result[HASH_LEN] = { // blake256( { 123 * 0 } 
@@ -272,6 +991,12 @@ void action_test() {
 		exit(1);
 	}
 
-	logger(INFO, "GPU hash test...");
-	test_gpu();
+	logger(INFO, "CPU leaf hash test...");
+	test_cpu_leaves();
+
+	logger(INFO, "CPU tree test...");
+	test_tree();
+
+	logger(INFO, "Library test...");
+	test_lib(BLAKETREE_CPU);
 }
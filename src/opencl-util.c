@@ -1,4 +1,15 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "opencl-util.h"
+#include "blake.h"
+#include "log.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 void ocl_strerror(cl_int err, char* buf, size_t buflen) {
 	const char *msg;
@@ -55,3 +66,223 @@ void ocl_strerror(cl_int err, char* buf, size_t buflen) {
 }
 
 char _ocl_errbuf[OCL_ERRBUF_SIZE];
+
+
+// program binary cache
+// > one file per platform, device, driver, source and build options, named by the
+//   BLAKE-256 hash of all of them
+// > written to a temporary file and renamed, so concurrent runs never read
+//   a partial binary
+
+static void hash_info(state256* S, cl_device_id device, cl_device_info param)
+{
+	char info[1024];
+	size_t len = 0;
+
+	if(clGetDeviceInfo(device, param, sizeof(info), info, &len) != CL_SUCCESS) {
+		len = 0;
+	}
+	blake256_update(S, (const uint8_t*) info, len);
+	blake256_update(S, (const uint8_t*) "", 1);
+}
+
+
+// the platform of device, e.g. two ICDs can drive the same device
+static void hash_platform_info(state256* S, cl_device_id device, cl_platform_info param)
+{
+	char info[1024];
+	size_t len = 0;
+	cl_platform_id platform;
+
+	if(clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL) != CL_SUCCESS
+		|| clGetPlatformInfo(platform, param, sizeof(info), info, &len) != CL_SUCCESS) {
+		len = 0;
+	}
+	blake256_update(S, (const uint8_t*) info, len);
+	blake256_update(S, (const uint8_t*) "", 1);
+}
+
+
+// returns 0 if caching is disabled or the path is too long
+static int cache_path(char* path, size_t pathlen, cl_device_id device, 
+	const char* source, const char* options)
+{
+	const char* dir = getenv(OCL_CACHE_ENV);
+	char base[PATH_MAX];
+	uint8_t key[32];
+	char hex[65];
+	state256 S;
+
+	if(dir && !*dir) {
+		return 0;
+	}
+	if(!dir) {
+		if(getenv("XDG_CACHE_HOME")) {
+			snprintf(base, sizeof(base), "%s/blaketree", getenv("XDG_CACHE_HOME"));
+		} else if(getenv("HOME")) {
+			snprintf(base, sizeof(base), "%s/.cache/blaketree", getenv("HOME"));
+		} else {
+			return 0;
+		}
+		dir = base;
+	}
+
+	// create the directory and its parents
+	char tmp[PATH_MAX];
+	int n = snprintf(tmp, sizeof(tmp), "%s", dir);
+	if(n < 0 || n >= sizeof(tmp)) {
+		return 0;
+	}
+	for(char* p = tmp + 1; *p; p++) {
+		if(*p == '/') {
+			*p = 0;
+			mkdir(tmp, 0755);
+			*p = '/';
+		}
+	}
+	if(mkdir(tmp, 0755) != 0 && errno != EEXIST) {
+		loggerf(DEBUG, "OpenCL cache: can't create %s: %s", dir, strerror(errno));
+		return 0;
+	}
+
+	blake256_init(&S);
+	hash_platform_info(&S, device, CL_PLATFORM_NAME);
+	hash_platform_info(&S, device, CL_PLATFORM_VERSION);
+	hash_info(&S, device, CL_DEVICE_VENDOR);
+	hash_info(&S, device, CL_DEVICE_NAME);
+	hash_info(&S, device, CL_DEVICE_VERSION);
+	hash_info(&S, device, CL_DRIVER_VERSION);
+	blake256_update(&S, (const uint8_t*) source, strlen(source) + 1);
+	blake256_update(&S, (const uint8_t*) options, strlen(options) + 1);
+	blake256_final(&S, key);
+
+	for(int i = 0; i < 32; i++) {
+		snprintf(&hex[2 * i], 3, "%02x", key[i]);
+	}
+	n = snprintf(path, pathlen, "%s/%s.bin", dir, hex);
+	return n > 0 && n < pathlen;
+}
+
+
+static cl_program cache_load(cl_context context, cl_device_id device, 
+	const char* path, const char* options)
+{
+	FILE* f = fopen(path, "rb");
+	unsigned char* binary;
+	size_t len;
+	cl_int err, status;
+	cl_program program;
+
+	if(!f) {
+		return NULL;
+	}
+	long end = -1;
+	if(fseek(f, 0, SEEK_END) == 0) {
+		end = ftell(f);
+	}
+	if(end <= 0 || fseek(f, 0, SEEK_SET) != 0) {
+		fclose(f);
+		return NULL;
+	}
+	len = end;
+	binary = malloc(len);
+	if(!binary || fread(binary, 1, len, f) != len) {
+		fclose(f);
+		free(binary);
+		return NULL;
+	}
+	fclose(f);
+
+	program = clCreateProgramWithBinary(context, 1, &device, &len, 
+		(const unsigned char**) &binary, &status, &err);
+	free(binary);
+	if(err != CL_SUCCESS || status != CL_SUCCESS) {
+		loggerf(DEBUG, "OpenCL cache: %s was rejected", path);
+		if(program) {
+			clReleaseProgram(program);
+		}
+		return NULL;
+	}
+
+	if(clBuildProgram(program, 1, &device, options, NULL, NULL) != CL_SUCCESS) {
+		loggerf(DEBUG, "OpenCL cache: %s doesn't build", path);
+		clReleaseProgram(program);
+		return NULL;
+	}
+	return program;
+}
+
+
+static void cache_store(cl_program program, const char* path)
+{
+	char tmp[PATH_MAX + 16];  // path and the pid
+	unsigned char* binary;
+	size_t len;
+	FILE* f;
+
+	if(clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(len), &len, NULL) != CL_SUCCESS
+		|| len == 0) 
+	{
+		return;
+	}
+	binary = malloc(len);
+	if(!binary) {
+		return;
+	}
+	if(clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL) != CL_SUCCESS) {
+		free(binary);
+		return;
+	}
+
+	int n = snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+	if(n < 0 || n >= sizeof(tmp)) {
+		free(binary);
+		return;
+	}
+	f = fopen(tmp, "wb");
+	if(f) {
+		bool ok = fwrite(binary, 1, len, f) == len;
+		ok = (fclose(f) == 0) && ok;
+		if(ok && rename(tmp, path) == 0) {
+			loggerf(DEBUG, "OpenCL cache: stored %s", path);
+		} else {
+			unlink(tmp);
+		}
+	}
+	free(binary);
+}
+
+
+cl_program ocl_build_program(cl_context context, cl_device_id device, 
+	const char* source, const char* options)
+{
+	char path[PATH_MAX];
+	cl_program program;
+	int err;
+	bool cached = cache_path(path, sizeof(path), device, source, options);
+
+	if(cached && (program = cache_load(context, device, path, options))) {
+		loggerf(DEBUG, "OpenCL cache: using %s", path);
+		return program;
+	}
+
+	program = clCreateProgramWithSource(context, 1, &source, NULL, &err);
+	ocl_assert(err);
+
+	err = clBuildProgram(program, 1, &device, options, NULL, NULL);
+	if (err != CL_SUCCESS)
+	{
+		logger(ERROR, "Failed to build program executable!");
+		size_t len;
+		static char buffer[0x100000];
+		clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 
+			sizeof(buffer), buffer, &len);
+		logger(ERROR, buffer);
+		exit(1);
+	}
+
+	if(cached) {
+		cache_store(program, path);
+	}
+	return program;
+}
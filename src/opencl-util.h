@@ -16,3 +16,15 @@ extern char _ocl_errbuf[OCL_ERRBUF_SIZE];
 		exit(1); \
 	} 
 
+
+// directory of the program binary cache, default ~/.cache/blaketree
+// > an empty value disables the cache
+#define OCL_CACHE_ENV "BLAKETREE_CL_CACHE"
+
+// create and build a program from source for one device
+// > the binary is cached on disk and reused while the device, driver, source
+//   and options stay the same
+// > exits with the build log if the source doesn't build
+cl_program ocl_build_program(cl_context context, cl_device_id device, 
+	const char* source, const char* options);
+
@@ -0,0 +1,473 @@
+// Per-machine profiles and the tuner that finds them, see profile.h
+#define _POSIX_C_SOURCE 200809L
+
+#include "profile.h"
+#include "BlakeTreeCPU.h"
+#include "BlakeTreeGPU.h"
+#include "BlakeTreePipeline.h"
+#include "log.h"
+#include "stats.h"
+#include "workload.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+#define TUNE_CPU_BYTES  (1 << 26)  // leaf hashing, in memory
+#define TUNE_FILE_BYTES (1 << 27)  // temporary file for the pipeline
+#define TUNE_GPU_BYTES  (1 << 28)  // per GPU configuration
+#define TUNE_RUNS 3                // the best run counts
+#define TUNE_MARGIN 1.02           // needed to beat an earlier candidate
+
+static const char* schedules[] = { "static", "dynamic,1", "dynamic,4", "guided", NULL };
+static const size_t chunk_sizes[] = { 1 << 20, 1 << 21, 1 << 22, 1 << 23, 1 << 24, 1 << 25, 0 };
+static const int depths[] = { 2, 4, 8, 0 };
+
+static const struct { const char* kernel; size_t local; } gpu_kernels[] = {
+	{ "staged", 0 }, { "simple", 0 }, { "simple", 64 }, { "simple", 128 }, { "simple", 256 },
+	{ NULL }
+};
+
+
+// returns false if profiles are disabled
+// > create makes the directory and its parents
+static bool profile_path(char* path, size_t size, bool create)
+{
+	const char* file = getenv(PROFILE_ENV);
+
+	if(file) {
+		snprintf(path, size, "%s", file);
+		return *file != 0;
+	}
+	if(getenv("XDG_CONFIG_HOME")) {
+		snprintf(path, size, "%s/blaketree/profile", getenv("XDG_CONFIG_HOME"));
+	} else if(getenv("HOME")) {
+		snprintf(path, size, "%s/.config/blaketree/profile", getenv("HOME"));
+	} else {
+		return false;
+	}
+
+	for(char* p = path + 1; create && *p; p++) {
+		if(*p == '/') {
+			*p = 0;
+			if(mkdir(path, 0755) != 0 && errno != EEXIST) {
+				loggerf(ERROR, "Profile: can't create %s: %s", path, strerror(errno));
+				*p = '/';
+				return false;
+			}
+			*p = '/';
+		}
+	}
+	return true;
+}
+
+
+// line is "[key]", with or without a newline
+static bool is_section(const char* line, const char* key)
+{
+	size_t len = strlen(key);
+	return line[0] == '[' && strncmp(&line[1], key, len) == 0 && line[len + 1] == ']';
+}
+
+
+static char* trim(char* s)
+{
+	while(*s == ' ' || *s == '\t') {
+		s++;
+	}
+	for(char* end = s + strlen(s); end > s && strchr(" \t\r\n", end[-1]); ) {
+		*--end = 0;
+	}
+	return s;
+}
+
+
+void profile_key(bool gpu, char* key, size_t size)
+{
+	char model[256] = "unknown", line[1024];
+
+	if(gpu) {
+		char devices[PROFILE_KEY_SIZE];
+		blakeTreeGPU_identity(devices, sizeof(devices));
+		snprintf(key, size, "gpu: %s", devices);
+	} else {
+		FILE* f = fopen("/proc/cpuinfo", "r");
+		while(f && fgets(line, sizeof(line), f)) {
+			char* colon = strchr(line, ':');
+			if(colon && strncmp(line, "model name", 10) == 0) {
+				snprintf(model, sizeof(model), "%s", trim(colon + 1));
+				break;
+			}
+		}
+		if(f) {
+			fclose(f);
+		}
+		snprintf(key, size, "cpu: %s, %ld threads", model, sysconf(_SC_NPROCESSORS_ONLN));
+	}
+
+	// one line, no end of the section name inside
+	for(char* p = key; *p; p++) {
+		if(*p == ']' || *p == '\n') {
+			*p = ' ';
+		}
+	}
+}
+
+
+bool profile_load(const char* key, profile_t* p)
+{
+	char path[1024], line[1024];
+	bool found = false, in_section = false;
+	FILE* f;
+
+	memset(p, 0, sizeof(*p));
+	if(!profile_path(path, sizeof(path), false) || !(f = fopen(path, "r"))) {
+		return false;
+	}
+
+	while(fgets(line, sizeof(line), f)) {
+		if(line[0] == '[') {
+			in_section = is_section(line, key);
+			found |= in_section;
+			continue;
+		}
+		char* eq = strchr(line, '=');
+		if(!in_section || line[0] == '#' || !eq) {
+			continue;
+		}
+		*eq = 0;
+		char *name = trim(line), *value = trim(eq + 1);
+
+		if(strcmp(name, "impl") == 0) {
+			snprintf(p->impl, sizeof(p->impl), "%s", value);
+		} else if(strcmp(name, "threads") == 0) {
+			p->threads = atoi(value);
+		} else if(strcmp(name, "schedule") == 0) {
+			snprintf(p->schedule, sizeof(p->schedule), "%s", value);
+		} else if(strcmp(name, "chunk") == 0) {
+			p->chunk = strtoull(value, NULL, 10);
+		} else if(strcmp(name, "depth") == 0) {
+			p->depth = atoi(value);
+		} else if(strcmp(name, "kernel") == 0) {
+			snprintf(p->kernel, sizeof(p->kernel), "%s", value);
+		} else if(strcmp(name, "local") == 0) {
+			p->local = strtoull(value, NULL, 10);
+		} else {
+			loggerf(DEBUG, "Profile: unknown setting \"%s\" in %s", name, path);
+		}
+	}
+	fclose(f);
+	return found;
+}
+
+
+// written to a temporary file and renamed, so a concurrent run never reads
+// half a profile
+bool profile_save(const char* key, const profile_t* p)
+{
+	char path[1024], tmp[1100], line[1024];
+	bool skip = false;
+	FILE *in, *out;
+
+	if(!profile_path(path, sizeof(path), true)) {
+		return false;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+	if(!(out = fopen(tmp, "w"))) {
+		loggerf(ERROR, "Profile: can't write %s: %s", tmp, strerror(errno));
+		return false;
+	}
+
+	// every other section stays
+	if((in = fopen(path, "r"))) {
+		while(fgets(line, sizeof(line), in)) {
+			if(line[0] == '[') {
+				skip = is_section(line, key);
+			}
+			if(!skip) {
+				fputs(line, out);
+			}
+		}
+		fclose(in);
+	} else {
+		fprintf(out, "# blaketree profiles, written by blaketree --autotune\n\n");
+	}
+
+	fprintf(out, "[%s]\n", key);
+	if(p->impl[0]) {
+		fprintf(out, "impl = %s\n", p->impl);
+	}
+	if(p->threads) {
+		fprintf(out, "threads = %d\n", p->threads);
+	}
+	if(p->schedule[0]) {
+		fprintf(out, "schedule = %s\n", p->schedule);
+	}
+	if(p->kernel[0]) {
+		fprintf(out, "kernel = %s\n", p->kernel);
+		fprintf(out, "local = %zu\n", p->local);
+	}
+	if(p->chunk) {
+		fprintf(out, "chunk = %zu\n", p->chunk);
+	}
+	if(p->depth) {
+		fprintf(out, "depth = %d\n", p->depth);
+	}
+	fprintf(out, "\n");
+
+	if(fclose(out) != 0 || rename(tmp, path) != 0) {
+		loggerf(ERROR, "Profile: can't write %s: %s", path, strerror(errno));
+		unlink(tmp);
+		return false;
+	}
+	return true;
+}
+
+
+// candidates are tried from the cheapest, a later one has to be clearly
+// faster to win
+static bool better(double rate, double* best)
+{
+	if(rate > *best * TUNE_MARGIN) {
+		*best = rate;
+		return true;
+	}
+	return false;
+}
+
+
+// leaf hashing throughput in bytes/s
+static double rate_leaves(const uint8_t* data, uint8_t* out)
+{
+	double best = 0;
+	size_t out_size;
+
+	blakeTreeCPU(data, TUNE_CPU_BYTES, bt_leaf_size, out, &out_size);
+	for(int i=0; i < TUNE_RUNS; i++) {
+		double t = stats_now();
+		blakeTreeCPU(data, TUNE_CPU_BYTES, bt_leaf_size, out, &out_size);
+		t = stats_now() - t;
+		if(TUNE_CPU_BYTES / t > best) {
+			best = TUNE_CPU_BYTES / t;
+		}
+	}
+	return best;
+}
+
+
+// pipeline throughput in bytes/s, with the current chunk size
+static double rate_pipeline(const char* filename, int depth)
+{
+	blakeTree_t tree;
+	uint8_t hash[HASH_LEN];
+	freader_t* r = freader_open(filename, FREADER_AUTO);
+
+	if(!r) {
+		return 0;
+	}
+	blakeTree_init(&tree, 0, 0);
+	double t = stats_now();
+	uint64_t bytes = blakeTreePipeline_run(r, depth, 1, &tree);
+	t = stats_now() - t;
+	blakeTree_final(&tree, bytes, hash);
+	freader_close(r);
+	return bytes / t;
+}
+
+
+// GPU pipeline throughput in bytes/s, with the current kernel and chunk size
+static double rate_gpu(const uint8_t* data, int depth)
+{
+	size_t total = (TUNE_GPU_BYTES / bt_chunk_size) * bt_chunk_size;
+
+	blakeTreeGPU_init(0, 0, depth);
+	// builds, first touch of the buffers
+	workload_gpu_pass(data, depth * bt_chunk_size, NULL);
+	double t = workload_gpu_pass(data, total, NULL);
+	blakeTreeGPU_close();
+	return total / t;
+}
+
+
+static void tune_cpu(const char* filename, const uint8_t* data, profile_t* p)
+{
+	uint8_t* out = malloc((TUNE_CPU_BYTES / bt_leaf_size + 1) * HASH_LEN);
+	const blake256_impl_t* best_impl = blake256_impl;
+	double best, rate;
+
+	if(!out) {
+		loggerf(ERROR, "Out of memory");
+		exit(1);
+	}
+
+	// backends, fastest first
+	best = 0;
+	for(const blake256_impl_t *impl = blake256_impls; impl->name; impl++) {
+		if(!impl->supported()) {
+			continue;
+		}
+		blake256_impl = impl;
+		rate = rate_leaves(data, out);
+		loggerf(DEBUG, "Tuning CPU: impl %s, %.1f MiB/s", impl->name, rate / 1048576);
+		if(better(rate, &best)) {
+			best_impl = impl;
+		}
+	}
+	blake256_impl = best_impl;
+	snprintf(p->impl, sizeof(p->impl), "%s", best_impl->name);
+
+	// threads, fewest first
+	int max = omp_get_num_procs();
+	best = 0;
+	for(int t=1; ; t = (t * 2 < max) ? t * 2 : max) {
+		blakeTreeCPU_set_threads(t);
+		rate = rate_leaves(data, out);
+		loggerf(DEBUG, "Tuning CPU: %d threads, %.1f MiB/s", t, rate / 1048576);
+		if(better(rate, &best)) {
+			p->threads = t;
+		}
+		if(t == max) {
+			break;
+		}
+	}
+	blakeTreeCPU_set_threads(p->threads);
+
+	best = 0;
+	for(int i=0; schedules[i]; i++) {
+		blakeTreeCPU_set_schedule(schedules[i]);
+		rate = rate_leaves(data, out);
+		loggerf(DEBUG, "Tuning CPU: schedule %s, %.1f MiB/s", schedules[i], rate / 1048576);
+		if(better(rate, &best)) {
+			snprintf(p->schedule, sizeof(p->schedule), "%s", schedules[i]);
+		}
+	}
+	blakeTreeCPU_set_schedule(p->schedule);
+	free(out);
+
+	// chunk size and depth, on the whole pipeline
+	// > one run first to bring the file into the page cache
+	size_t leaf_size = bt_leaf_size;
+	rate_pipeline(filename, PIPELINE_DEFAULT_DEPTH);
+	best = 0;
+	for(int c=0; chunk_sizes[c]; c++) {
+		if(!blakeTree_set_geometry(leaf_size, chunk_sizes[c])) {
+			continue;
+		}
+		for(int d=0; depths[d]; d++) {
+			rate = rate_pipeline(filename, depths[d]);
+			loggerf(DEBUG, "Tuning CPU: chunk %zu, depth %d, %.1f MiB/s",
+				chunk_sizes[c], depths[d], rate / 1048576);
+			if(better(rate, &best)) {
+				p->chunk = chunk_sizes[c];
+				p->depth = depths[d];
+			}
+		}
+	}
+	blakeTree_set_geometry(leaf_size, p->chunk);
+
+	loggerf(INFO, "CPU: impl %s, threads %d, schedule %s, chunk %zu, depth %d, %.1f MiB/s",
+		p->impl, p->threads, p->schedule, p->chunk, p->depth, best / 1048576);
+}
+
+
+static void tune_gpu(const uint8_t* data, profile_t* p)
+{
+	size_t leaf_size = bt_leaf_size;
+	double best, rate;
+
+	// kernels, with the default chunk size and depth
+	best = 0;
+	blakeTree_set_geometry(leaf_size, BT_DEFAULT_CHUNK_SIZE);
+	for(int k=0; gpu_kernels[k].kernel; k++) {
+		blakeTreeGPU_select_kernel(gpu_kernels[k].kernel);
+		blakeTreeGPU_set_local(gpu_kernels[k].local);
+		rate = rate_gpu(data, GPU_DEFAULT_DEPTH);
+		loggerf(DEBUG, "Tuning GPU: kernel %s, local %zu, %.1f MiB/s",
+			gpu_kernels[k].kernel, gpu_kernels[k].local, rate / 1048576);
+		if(better(rate, &best)) {
+			snprintf(p->kernel, sizeof(p->kernel), "%s", gpu_kernels[k].kernel);
+			p->local = gpu_kernels[k].local;
+		}
+	}
+	blakeTreeGPU_select_kernel(p->kernel);
+	blakeTreeGPU_set_local(p->local);
+
+	best = 0;
+	for(int c=0; chunk_sizes[c]; c++) {
+		if(!blakeTree_set_geometry(leaf_size, chunk_sizes[c])) {
+			continue;
+		}
+		for(int d=0; depths[d]; d++) {
+			rate = rate_gpu(data, depths[d]);
+			loggerf(DEBUG, "Tuning GPU: chunk %zu, depth %d, %.1f MiB/s",
+				chunk_sizes[c], depths[d], rate / 1048576);
+			if(better(rate, &best)) {
+				p->chunk = chunk_sizes[c];
+				p->depth = depths[d];
+			}
+		}
+	}
+	blakeTree_set_geometry(leaf_size, p->chunk);
+
+	loggerf(INFO, "GPU: kernel %s, local %zu, chunk %zu, depth %d, %.1f MiB/s",
+		p->kernel, p->local, p->chunk, p->depth, best / 1048576);
+}
+
+
+// a file of TUNE_FILE_BYTES for the pipeline, returns false on errors
+static bool temp_file(char* path, size_t size, const uint8_t* data)
+{
+	const char* dir = getenv("TMPDIR");
+	snprintf(path, size, "%s/blaketree-tune-XXXXXX", dir && *dir ? dir : "/tmp");
+
+	int fd = mkstemp(path);
+	if(fd < 0) {
+		return false;
+	}
+	for(size_t done = 0; done < TUNE_FILE_BYTES; done += TUNE_CPU_BYTES) {
+		if(write(fd, data, TUNE_CPU_BYTES) != TUNE_CPU_BYTES) {
+			close(fd);
+			unlink(path);
+			return false;
+		}
+	}
+	close(fd);
+	return true;
+}
+
+
+void profile_tune_cpu(const char* filename, profile_t* p)
+{
+	char tmp[1024];
+	uint8_t* data = workload_alloc(TUNE_CPU_BYTES);
+
+	if(!filename) {
+		if(!temp_file(tmp, sizeof(tmp), data)) {
+			loggerf(ERROR, "Can't write a temporary file to tune with: %s", strerror(errno));
+			exit(1);
+		}
+		filename = tmp;
+	}
+
+	memset(p, 0, sizeof(*p));
+	tune_cpu(filename, data, p);
+
+	if(filename == tmp) {
+		unlink(tmp);
+	}
+	free(data);
+}
+
+
+void profile_tune_gpu(profile_t* p)
+{
+	uint8_t* data = workload_alloc(TUNE_CPU_BYTES);
+
+	memset(p, 0, sizeof(*p));
+	tune_gpu(data, p);
+	free(data);
+}
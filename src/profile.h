@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Per-machine settings, found by blaketree --autotune
+//
+// The profile file has one section per CPU and one per set of OpenCL
+// devices, named by their identity, so one file can serve a whole fleet:
+//
+//   [cpu: Intel(R) Core(TM) i7-8700 CPU @ 3.20GHz, 12 threads]
+//   impl = avx2
+//   threads = 6
+//   schedule = dynamic,4
+//   chunk = 4194304
+//   depth = 4
+//
+// Normal runs load the sections of the machine they run on, explicit
+// options and environment variables win. Settings that are missing keep
+// their defaults.
+
+// the profile file, default ~/.config/blaketree/profile
+// > an empty value disables profiles
+#define PROFILE_ENV "BLAKETREE_PROFILE"
+
+#define PROFILE_KEY_SIZE 1024
+
+// 0 or "" if not set
+typedef struct {
+	char   impl[16];      // CPU implementation, see blake.h
+	int    threads;       // OpenMP threads hashing leaves
+	char   schedule[32];  // OpenMP schedule, see blakeTreeCPU_set_schedule()
+	size_t chunk;         // chunk size
+	int    depth;         // CPU pipeline depth or GPU buffers per device
+	char   kernel[16];    // GPU leaf kernel
+	size_t local;         // work-group size of the simple GPU kernel
+} profile_t;
+
+// section name of the CPU, or of the OpenCL devices blakeTreeGPU_init()
+// would use
+void profile_key(bool gpu, char* key, size_t size);
+
+// returns false if there is no section for key
+bool profile_load(const char* key, profile_t* p);
+
+// adds the section of key or replaces it, returns false on errors
+bool profile_save(const char* key, const profile_t* p);
+
+// search the fastest settings, one knob after the other, with the current
+// leaf size
+// > the settings they try stay changed, the winners are selected at the end
+
+// backend, threads and schedule on data in memory, then chunk size and depth
+// of the pipeline reading filename (a temporary file if NULL)
+void profile_tune_cpu(const char* filename, profile_t* p);
+
+// leaf kernel and work-group size, then chunk size and depth, on data in
+// memory
+// > exits if there is no OpenCL device, like blakeTreeGPU_init()
+void profile_tune_gpu(profile_t* p);
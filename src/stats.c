@@ -0,0 +1,125 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+bool stats_enabled = false;
+
+typedef struct {
+	double* samples;
+	size_t count;
+	size_t cap;
+	uint64_t bytes;
+	double total;
+} stage_t;
+
+static stage_t stages[STATS_STAGES];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* stage_names[STATS_STAGES] = {
+	"read", "write", "kernel", "readback", "cpu", "master", "stall", "idle"
+};
+
+
+double stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+void stats_add(enum stats_stage stage, double sec, size_t bytes)
+{
+	if(!stats_enabled) {
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	stage_t* s = &stages[stage];
+	if(s->count == s->cap) {
+		s->cap = s->cap ? 2 * s->cap : 256;
+		s->samples = realloc(s->samples, s->cap * sizeof(double));
+		if(!s->samples) {
+			fprintf(stderr, "ERROR: Out of memory for statistics\n");
+			exit(1);
+		}
+	}
+	s->samples[s->count++] = sec;
+	s->total += sec;
+	s->bytes += bytes;
+	pthread_mutex_unlock(&lock);
+}
+
+
+void stats_total(enum stats_stage stage, double* sec, uint64_t* bytes)
+{
+	pthread_mutex_lock(&lock);
+	*sec   = stages[stage].total;
+	*bytes = stages[stage].bytes;
+	pthread_mutex_unlock(&lock);
+}
+
+
+void stats_reset(void)
+{
+	pthread_mutex_lock(&lock);
+	for(int i=0; i < STATS_STAGES; i++) {
+		stages[i].count = 0;
+		stages[i].bytes = 0;
+		stages[i].total = 0;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+
+static int compare_double(const void* a, const void* b)
+{
+	double x = *(const double*) a, y = *(const double*) b;
+	return (x > y) - (x < y);
+}
+
+
+// nearest rank, samples sorted
+static double percentile(const stage_t* s, int p)
+{
+	size_t rank = (s->count * p + 99) / 100;
+	return s->samples[rank ? rank - 1 : 0];
+}
+
+
+void stats_report(double wall_sec)
+{
+	if(!stats_enabled) {
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	fprintf(stderr, "%-9s %7s %9s %7s %9s %9s %9s %9s %9s\n", "stage", "chunks", 
+		"total s", "% wall", "MiB/s", "p50 ms", "p90 ms", "p99 ms", "max ms");
+
+	for(int i=0; i < STATS_STAGES; i++) {
+		stage_t* s = &stages[i];
+		if(s->count == 0) {
+			continue;
+		}
+		qsort(s->samples, s->count, sizeof(double), compare_double);
+
+		char rate[32] = "-";
+		if(s->bytes && s->total > 0) {
+			snprintf(rate, sizeof(rate), "%.1f", (s->bytes / 1048576.0) / s->total);
+		}
+		fprintf(stderr, "%-9s %7zu %9.3f %7.1f %9s %9.3f %9.3f %9.3f %9.3f\n", 
+			stage_names[i], s->count, s->total, 
+			wall_sec > 0 ? 100 * s->total / wall_sec : 0, rate,
+			1e3 * percentile(s, 50), 1e3 * percentile(s, 90), 
+			1e3 * percentile(s, 99), 1e3 * s->samples[s->count - 1]);
+	}
+	fprintf(stderr, "%-9s %7s %9.3f\n", "wall", "", wall_sec);
+	pthread_mutex_unlock(&lock);
+}
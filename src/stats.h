@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// per-stage timings of a run, see -s
+// > every stage records one sample per chunk: its duration and bytes
+enum stats_stage {
+	STATS_READ,      // file reads
+	STATS_WRITE,     // host to device transfers, from OpenCL profiling
+	STATS_KERNEL,    // device kernels of a chunk, first start to last end
+	STATS_READBACK,  // device to host transfers, from OpenCL profiling
+	STATS_CPU,       // leaf hashing on the CPU, in hybrid mode its share
+	STATS_MASTER,    // master update with the hashes of a chunk
+	STATS_STALL,     // reading waited for a free buffer, hashing is behind
+	STATS_IDLE,      // hashing waited for a read, the input is behind
+	STATS_STAGES
+};
+
+extern bool stats_enabled;
+
+// monotonic clock, in seconds
+double stats_now(void);
+
+// thread-safe, does nothing unless stats_enabled
+void stats_add(enum stats_stage stage, double sec, size_t bytes);
+
+// sums of a stage since the start or the last stats_reset()
+void stats_total(enum stats_stage stage, double* sec, uint64_t* bytes);
+void stats_reset(void);
+
+// totals, share of the wall time, throughput and percentiles of every
+// stage, on stderr
+void stats_report(double wall_sec);
@@ -0,0 +1,147 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "trace.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+bool trace_enabled = false;
+
+typedef struct {
+	const char* name;
+	uint64_t start;   // ns
+	uint64_t end;
+	uint64_t bytes;
+} trace_event_t;
+
+// one per thread, never freed so it can be written after the thread exits
+// > only the owner writes events, the list is only read at exit
+typedef struct trace_buf {
+	struct trace_buf* next;
+	int tid;
+	const char* thread_name;
+	uint64_t count;   // events recorded, slot = count % TRACE_EVENTS
+	trace_event_t events[TRACE_EVENTS];
+} trace_buf_t;
+
+static trace_buf_t* buffers;  // lock-free list of all thread buffers
+static int next_tid;
+static __thread trace_buf_t* own;
+
+static FILE* out;
+static uint64_t epoch;
+
+
+uint64_t trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static trace_buf_t* own_buffer(void)
+{
+	if(!own) {
+		own = calloc(1, sizeof(trace_buf_t));
+		if(!own) {
+			trace_enabled = false;
+			return NULL;
+		}
+		own->tid = __atomic_add_fetch(&next_tid, 1, __ATOMIC_RELAXED);
+		own->next = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&buffers, &own->next, own, true,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	return own;
+}
+
+
+void trace_record(const char* name, uint64_t start, uint64_t bytes)
+{
+	trace_buf_t* b = own_buffer();
+	if(!b) {
+		return;
+	}
+	trace_event_t* e = &b->events[b->count % TRACE_EVENTS];
+	e->name  = name;
+	e->start = start;
+	e->end   = trace_now();
+	e->bytes = bytes;
+	b->count++;
+}
+
+
+void trace_thread_name(const char* name)
+{
+	if(trace_enabled) {
+		trace_buf_t* b = own_buffer();
+		if(b) {
+			b->thread_name = name;
+		}
+	}
+}
+
+
+// microseconds since trace_open(), as Chrome expects
+static double usec(uint64_t ns)
+{
+	return (ns > epoch ? ns - epoch : 0) / 1000.0;
+}
+
+
+static void trace_write(void)
+{
+	int pid = getpid();
+	const char* sep = "";
+
+	trace_enabled = false;
+	fprintf(out, "{\"traceEvents\":[\n");
+
+	for(trace_buf_t* b = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); b; b = b->next) {
+		uint64_t first = (b->count > TRACE_EVENTS) ? b->count - TRACE_EVENTS : 0;
+
+		if(b->thread_name) {
+			fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+				"\"args\":{\"name\":\"%s\"}}", sep, pid, b->tid, b->thread_name);
+			sep = ",\n";
+		}
+		for(uint64_t i = first; i < b->count; i++) {
+			trace_event_t* e = &b->events[i % TRACE_EVENTS];
+			fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+				"\"ts\":%.3f,\"dur\":%.3f", sep, e->name, pid, b->tid, 
+				usec(e->start), (e->end - e->start) / 1000.0);
+			if(e->bytes) {
+				fprintf(out, ",\"args\":{\"bytes\":%llu}", (unsigned long long) e->bytes);
+			}
+			fprintf(out, "}");
+			sep = ",\n";
+		}
+		if(first) {
+			loggerf(DEBUG, "Trace: %llu early events of thread %d dropped", 
+				(unsigned long long) first, b->tid);
+		}
+	}
+
+	fprintf(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	fclose(out);
+}
+
+
+int trace_open(const char* path)
+{
+	if(out) {
+		return 1;
+	}
+	out = fopen(path, "w");
+	if(!out) {
+		return 0;
+	}
+	epoch = trace_now();
+	trace_enabled = true;
+	atexit(trace_write);
+	return 1;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// timeline trace of the pipeline, see -T
+// > every thread records spans into its own ring of TRACE_EVENTS, without
+//   locks; once full the oldest spans are overwritten
+// > written at exit as Chrome trace JSON (chrome://tracing, Perfetto)
+// > disabled, a span costs one branch
+#define TRACE_ENV "BLAKETREE_TRACE"
+#define TRACE_EVENTS (1 << 15)
+
+extern bool trace_enabled;
+
+// start tracing into path, written at exit
+// > returns 0 if path can't be written
+int trace_open(const char* path);
+
+uint64_t trace_now(void);
+
+// name must be a string literal, bytes is shown as an argument if > 0
+void trace_record(const char* name, uint64_t start, uint64_t bytes);
+
+// label of the calling thread in the timeline
+void trace_thread_name(const char* name);
+
+static inline uint64_t trace_begin(void)
+{
+	return trace_enabled ? trace_now() : 0;
+}
+
+static inline void trace_end(const char* name, uint64_t start, uint64_t bytes)
+{
+	if(trace_enabled) {
+		trace_record(name, start, bytes);
+	}
+}
@@ -0,0 +1,234 @@
+#define _DEFAULT_SOURCE
+
+#include "uring.h"
+#include "log.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+struct uring {
+	int fd;
+
+	void* sq_ring;
+	void* cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe* cqes;
+
+	unsigned queued;  // entries not handed to the kernel yet
+};
+
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+uring_t* uring_init(unsigned entries)
+{
+	struct io_uring_params p;
+	uring_t* u;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = sys_io_uring_setup(entries, &p);
+	if(fd < 0) {
+		loggerf(DEBUG, "io_uring_setup() failed: %s", strerror(errno));
+		return NULL;
+	}
+
+	u = calloc(1, sizeof(uring_t));
+	u->fd = fd;
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(u->cq_ring_size > u->sq_ring_size) {
+			u->sq_ring_size = u->cq_ring_size;
+		}
+		u->cq_ring_size = u->sq_ring_size;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, 
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if(u->sq_ring == MAP_FAILED) {
+		goto fail;
+	}
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, 
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if(u->cq_ring == MAP_FAILED) {
+			goto fail;
+		}
+	}
+
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, 
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if(u->sqes == MAP_FAILED) {
+		goto fail;
+	}
+
+	u->sq_head  = (unsigned*)((uint8_t*) u->sq_ring + p.sq_off.head);
+	u->sq_tail  = (unsigned*)((uint8_t*) u->sq_ring + p.sq_off.tail);
+	u->sq_mask  = (unsigned*)((uint8_t*) u->sq_ring + p.sq_off.ring_mask);
+	u->sq_array = (unsigned*)((uint8_t*) u->sq_ring + p.sq_off.array);
+
+	u->cq_head  = (unsigned*)((uint8_t*) u->cq_ring + p.cq_off.head);
+	u->cq_tail  = (unsigned*)((uint8_t*) u->cq_ring + p.cq_off.tail);
+	u->cq_mask  = (unsigned*)((uint8_t*) u->cq_ring + p.cq_off.ring_mask);
+	u->cqes     = (struct io_uring_cqe*)((uint8_t*) u->cq_ring + p.cq_off.cqes);
+
+	return u;
+
+fail:
+	loggerf(DEBUG, "io_uring mmap() failed: %s", strerror(errno));
+	uring_exit(u);
+	return NULL;
+}
+
+
+int uring_register_buffers(uring_t* u, uint8_t** bufs, unsigned count, size_t len)
+{
+	struct iovec iov[count];
+
+	for(unsigned i=0; i < count; i++) {
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len  = len;
+	}
+	if(sys_io_uring_register(u->fd, IORING_REGISTER_BUFFERS, iov, count) < 0) {
+		loggerf(DEBUG, "io_uring buffer registration failed: %s", strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+
+// hands the queued entries to the kernel, waits for min_complete
+// completions at the same time
+static void uring_enter(uring_t* u, unsigned min_complete)
+{
+	unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	int n;
+
+	while((n = sys_io_uring_enter(u->fd, u->queued, min_complete, flags)) < 0) {
+		if(errno != EINTR && errno != EAGAIN) {
+			loggerf(ERROR, "io_uring_enter() failed: %s", strerror(errno));
+			exit(1);
+		}
+	}
+	u->queued -= n;
+}
+
+
+static int uring_pop(uring_t* u, uint64_t* tag, int* res)
+{
+	unsigned head = *u->cq_head;
+	struct io_uring_cqe* cqe;
+
+	if(head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+
+	cqe = &u->cqes[head & *u->cq_mask];
+	*tag = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+
+// the callers never have more reads in flight than ring entries,
+// so there is always a free submission queue entry
+// > only queued, the next uring_wait() or uring_poll() submits every
+//   queued read with one system call
+void uring_read(uring_t* u, int fd, uint8_t* buf, size_t len, uint64_t offset,
+	int buf_index, uint64_t tag)
+{
+	unsigned tail = *u->sq_tail;
+	unsigned index = tail & *u->sq_mask;
+	struct io_uring_sqe* sqe = &u->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode    = (buf_index < 0) ? IORING_OP_READ : IORING_OP_READ_FIXED;
+	sqe->fd        = fd;
+	sqe->addr      = (uint64_t)(uintptr_t) buf;
+	sqe->len       = len;
+	sqe->off       = offset;
+	sqe->buf_index = (buf_index < 0) ? 0 : buf_index;
+	sqe->user_data = tag;
+
+	u->sq_array[index] = index;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->queued++;
+}
+
+
+int uring_poll(uring_t* u, uint64_t* tag, int* res)
+{
+	if(u->queued) {
+		uring_enter(u, 0);
+	}
+	return uring_pop(u, tag, res);
+}
+
+
+// submitting and waiting is one system call
+int uring_wait(uring_t* u, uint64_t* tag)
+{
+	int res;
+
+	if(u->queued) {
+		if(uring_pop(u, tag, &res)) {
+			uring_enter(u, 0);
+			return res;
+		}
+		uring_enter(u, 1);
+	}
+	while(!uring_pop(u, tag, &res)) {
+		uring_enter(u, 1);
+	}
+	return res;
+}
+
+
+void uring_exit(uring_t* u)
+{
+	if(u->sqes && u->sqes != MAP_FAILED) {
+		munmap(u->sqes, u->sqes_size);
+	}
+	if(u->cq_ring && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring) {
+		munmap(u->cq_ring, u->cq_ring_size);
+	}
+	if(u->sq_ring && u->sq_ring != MAP_FAILED) {
+		munmap(u->sq_ring, u->sq_ring_size);
+	}
+	close(u->fd);
+	free(u);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Minimal io_uring wrapper for reads, talks to the kernel directly
+// > no liburing dependency, only the few operations the readers need
+
+typedef struct uring uring_t;
+
+// returns NULL if io_uring isn't available (old kernel, seccomp, ...)
+uring_t* uring_init(unsigned entries);
+
+// pins the buffers for IORING_OP_READ_FIXED, returns 0 on failure
+// (e.g. RLIMIT_MEMLOCK), plain reads still work then
+int uring_register_buffers(uring_t* u, uint8_t** bufs, unsigned count, size_t len);
+
+// queues a read, buf_index < 0 for unregistered buffers
+// > the tag is returned with the completion
+// > the queued reads are submitted together by uring_wait() or uring_poll()
+void uring_read(uring_t* u, int fd, uint8_t* buf, size_t len, uint64_t offset,
+	int buf_index, uint64_t tag);
+
+// submits the queued reads, blocks until a read completes, returns its
+// result (bytes or -errno)
+int uring_wait(uring_t* u, uint64_t* tag);
+
+// like uring_wait(), returns 0 instead of blocking if nothing completed
+int uring_poll(uring_t* u, uint64_t* tag, int* res);
+
+void uring_exit(uring_t* u);
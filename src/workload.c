@@ -0,0 +1,55 @@
+#include "workload.h"
+#include "BlakeTreeGPU.h"
+#include "log.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+void workload_fill(uint8_t* data, size_t length)
+{
+	for(size_t i=0; i < length; i++) {
+		data[i] = (uint8_t)(i * 31 + (i >> 11));
+	}
+}
+
+
+uint8_t* workload_alloc(size_t length)
+{
+	uint8_t* data = malloc(length);
+
+	if(!data) {
+		loggerf(ERROR, "Out of memory");
+		exit(1);
+	}
+	workload_fill(data, length);
+	return data;
+}
+
+
+double workload_gpu_pass(const uint8_t* data, size_t total, double* host)
+{
+	size_t submitted = 0, done = 0;
+	double copy = 0;
+	uint8_t* src;
+
+	double start = stats_now();
+	while(done < total) {
+		if(blakeTreeGPU_acquire_dst(NULL, NULL)) {
+			blakeTreeGPU_release_dst();
+			done += bt_chunk_size;
+		}
+		while(submitted < total && (src = blakeTreeGPU_acquire_src())) {
+			double t = stats_now();
+			memcpy(src, data, bt_chunk_size);
+			copy += stats_now() - t;
+			blakeTreeGPU_enqueue_src(bt_chunk_size);
+			submitted += bt_chunk_size;
+		}
+	}
+	if(host) {
+		*host = copy;
+	}
+	return stats_now() - start;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Synthetic input of the benchmark, the autotuner and the tests, so they all
+// measure the same thing
+
+// the reference pattern, not constant so no page or hash is trivial
+void workload_fill(uint8_t* data, size_t length);
+
+// length bytes of the pattern, exits if out of memory
+uint8_t* workload_alloc(size_t length);
+
+// push total bytes through the GPU ring, like a file would be, every chunk
+// copied from the start of data
+// > returns the wall time in seconds
+// > host (if not NULL): the time spent copying the data into the buffers,
+//   where a read would put it
+double workload_gpu_pass(const uint8_t* data, size_t total, double* host);